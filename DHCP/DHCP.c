@@ -85,9 +85,9 @@ static void DHCPsendInit(void) {
 			expectedID = packet.xid;
 
 			sendIPv4packet(&broadcastIP, &(const struct IPv4){{0, 0, 0, 0}}, PROTO_UDP, udp.length, 3, 
-						   LAYERS({&udp, sizeof(udp)},
-								  {&packet, sizeof(packet)},
-								  {options, sizeof(options)}));
+						   LAYERS({&udp, sizeof(udp), LAYER_RAM},
+								  {&packet, sizeof(packet), LAYER_RAM},
+								  {options, sizeof(options), LAYER_RAM}));
 			break;
 		}
 		case INIT_REBOOT: {
@@ -114,9 +114,9 @@ static void DHCPsendInit(void) {
 			expectedID = packet.xid;
 
 			sendIPv4packet(&broadcastIP, &(const struct IPv4){{0, 0, 0, 0}}, PROTO_UDP, udp.length, 3, 
-							LAYERS({&udp, sizeof(udp)},
-								   {&packet, sizeof(packet)},
-								   {options, sizeof(options)}));
+							LAYERS({&udp, sizeof(udp), LAYER_RAM},
+								   {&packet, sizeof(packet), LAYER_RAM},
+								   {options, sizeof(options), LAYER_RAM}));
 			break;
 		}
 		default:
@@ -145,9 +145,9 @@ void handleDHCPtimers(void) {
 		state = RENEWING;
 		expectedID = packet.xid;
 		sendIPv4packet(&routerIP, &localIP, PROTO_UDP, udp.length, 3, 
-									LAYERS({&udp, sizeof(udp)},
-										   {&packet, sizeof(packet)},
-										   {options, sizeof(options)}));
+									LAYERS({&udp, sizeof(udp), LAYER_RAM},
+										   {&packet, sizeof(packet), LAYER_RAM},
+										   {options, sizeof(options), LAYER_RAM}));
 	}
 	else if(state == RENEWING && RTCtimerDone(T2)) {
 		// send broadcast request
@@ -168,9 +168,9 @@ void handleDHCPtimers(void) {
 		state = RENEWING;
 		expectedID = packet.xid;
 		sendIPv4packet(&broadcastIP, &localIP, PROTO_UDP, udp.length, 3, 
-									LAYERS({&udp, sizeof(udp)},
-										   {&packet, sizeof(packet)},
-										   {options, sizeof(options)}));
+									LAYERS({&udp, sizeof(udp), LAYER_RAM},
+										   {&packet, sizeof(packet), LAYER_RAM},
+										   {options, sizeof(options), LAYER_RAM}));
 		state = REBINDING;
 	}
 }
@@ -205,9 +205,9 @@ void DHCPprocessor(const struct DHCPheader *const restrict dhcp) {
 					expectedID = packet.xid;
 
 					sendIPv4packet(&broadcastIP, &(const struct IPv4){{0, 0, 0, 0}}, PROTO_UDP, udp.length, 3, 
-									LAYERS({&udp, sizeof(udp)},
-										   {&packet, sizeof(packet)},
-										   {options, sizeof(options)}));
+									LAYERS({&udp, sizeof(udp), LAYER_RAM},
+										   {&packet, sizeof(packet), LAYER_RAM},
+										   {options, sizeof(options), LAYER_RAM}));
 
 				}
 				break;
@@ -13,6 +13,7 @@
 static inline uint32_t CRC32(const uint8_t data[], const uint8_t len);
 static void checkBank(const uint8_t registerName);
 static void writeBuffer(const uint8_t *const data, const uint16_t len);
+static void writeBufferFlash(const uint8_t *const data, const uint16_t len);
 static void readBuffer(uint8_t dest[], const uint16_t len);
 static uint16_t npp = RX_BUF_ST;
 
@@ -173,6 +174,12 @@ void DMAcopy(const uint16_t srcStart, const uint16_t srcStop, const uint16_t des
 	return;
 }
 
+void writeBufferAt(const uint16_t address, const void *const data, const uint16_t len)
+{
+	WriteWord(EWRPT, address); // sendEthernetFrame() sets it again for every frame, so it can be moved freely
+	writeBuffer(data, len);
+}
+
 void DMAchecksum(const uint16_t start, const uint16_t stop)
 {
 	while(ReadReg(ECON1) & (1 << DMAST)); // Wait till DMAST clears
@@ -205,7 +212,18 @@ void sendEthernetFrame(const struct MAC *const dest, const struct MAC *const src
 	writeBuffer(firstData, firstLen); // Write the first block of data (usually ARP or IP)
 	for(uint8_t i = 0; i < layers; i++) // Write all the additional blocks from the layer list
 	{
-		writeBuffer(payload[i].data, payload[i].len);
+		if(payload[i].source == LAYER_NIC && payload[i].len > 0) // Already in buffer memory, so the DMA copies it into the frame
+		{
+			const uint16_t at = ReadWord(EWRPT);
+			const uint16_t src = (uintptr_t)payload[i].data;
+			DMAcopy(src, src + payload[i].len - 1, at);
+			while(ReadReg(ECON1) & (1 << DMAST)); // Wait till DMAST clears
+			WriteWord(EWRPT, at + payload[i].len);
+		}
+		else if(payload[i].source == LAYER_FLASH)
+			writeBufferFlash(payload[i].data, payload[i].len);
+		else
+			writeBuffer(payload[i].data, payload[i].len);
 	}
 	const uint16_t packetEnd = ReadWord(EWRPT);
 	WriteWord(ETXND, packetEnd - 1); // Write pointer ends up right after packet
@@ -374,6 +392,20 @@ static void writeBuffer(const uint8_t *const data, const uint16_t len)
   }
 }
 
+static void writeBufferFlash(const uint8_t *const data, const uint16_t len) // Same as writeBuffer() with data in flash
+{
+	if(len > 0) {
+		SS_low();
+		SerialTX(WBM);
+		for(uint16_t d = 0; d < len; d++)
+		{
+			SerialTX(pgm_read_byte(&data[d]));
+		}
+		SerialTXend();
+		SS_high();
+	}
+}
+
 static void readBuffer(uint8_t dest[], const uint16_t len)
 {
 		printf("ERB-");
@@ -38,6 +38,8 @@ extern void IPv6reset(const uint8_t resetType);
 
 extern void DMAcopy(const uint16_t srcStart, const uint16_t srcStop, const uint16_t dest);
 
+extern void writeBufferAt(const uint16_t address, const void *const data, const uint16_t len);
+
 extern void DMAchecksum(const uint16_t start, const uint16_t stop);
 
 extern uint16_t getChecksum(void);
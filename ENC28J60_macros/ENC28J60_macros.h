@@ -51,6 +51,7 @@ struct __attribute__((packed)) RXstatusVector // Data written by ENC28J60 before
 #define RX_BUF_END 4573U // Must be odd number
 #define TX_BUF_ST 4574U // Must be even number
 #define PACKET_ST (TX_BUF_ST + 1)
+#define NIC_POOL_ST 6144U // Spare buffer memory the Ring module keeps chunks in, past room for a full size frame and its status vector
 #define BUF_END 8191U // Last address
 #define BUF_LEN 8192U // 8 kilobytes
 #define ETHERNET_LEN 14U // Two MAC addresses and ethertype field
@@ -21,10 +21,16 @@ extern "C" {
 
 #define PORTS(x) ((struct CommonPorts *)(x))
 
+// Where the data of a struct Layer is
+#define LAYER_RAM 0
+#define LAYER_NIC 1 // data is an address in the ENC28J60's buffer memory
+#define LAYER_FLASH 2 // data points to program memory (PROGMEM)
+
 struct Layer 
 {
-	const void *const data;
-	const uint16_t len;
+	const void *data;
+	uint16_t len;
+	uint8_t source; // One of the LAYER_ values above
 };
 #define LAYERS(...) ((const struct Layer []){__VA_ARGS__})
 
@@ -4,11 +4,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <stdio.h>
 #include <util/delay.h>
 #include "uartlibrary/uart.h"
 #include "HeaderStructs/HeaderStructs.h"
 #include "RTC/RTC.h"
+#include "Timer/Timer.h"
 #include "WebserverDriver/WebserverDriver.h"
 #include "DHCP/DHCP.h"
 #define STR(x) PSTR(#x)
@@ -20,7 +22,7 @@
 #endif
 
 
-static const char html[] = {
+static const char html[] PROGMEM = { // Sent straight from flash
 #include "Homepage.html"
 };
 
@@ -32,6 +34,7 @@ static const char httpHeader[] = {
 // Finish with Content-Length: sizeof(html)\r\n\r\n
 
 static void addClient(const int8_t toAdd);
+static uint8_t spansStartWith(const struct Layer spans[], uint16_t len, const char *str);
 static int write_char_helper(char var, FILE *stream);
 static int read_char_helper(FILE *stream);
 static FILE mystream = FDEV_SETUP_STREAM(write_char_helper, read_char_helper, _FDEV_SETUP_RW);
@@ -66,6 +69,7 @@ int main(void)
     RTCinit();
     RTCsetTimeZone(TIMEZONE / 100);
     RTCsetTime(SECOND, MINUTE, HOUR, DAY, MONTH, YEAR); // Sets with local time of compilation
+    TimerInit();
 
     NICsetup();
 
@@ -92,7 +96,7 @@ int main(void)
     packetHandler();
     
 
-    uint8_t buf[1000];
+    struct Layer request[2]; // Enough to see how the request starts, it is looked at in place in the RX buffer
   	while(1)
   	{
         packetHandler();
@@ -101,28 +105,22 @@ int main(void)
             addClient(ret);
 
         for(uint8_t i = 0; i < sizeof(clients); i++) {
-            int16_t retvalTCP = recv(clients[i], buf, sizeof(buf), MSG_DONTWAIT); // We'll assume this will read the whole header
-            if(retvalTCP > 0 && memcmp(buf, "GET", 3) == 0) {
+            int16_t retvalTCP = recvpeek(clients[i], request, 2, MSG_DONTWAIT); // We'll assume this is the whole header
+            const uint8_t isGET = retvalTCP > 0 && spansStartWith(request, retvalTCP, "GET");
+            if(retvalTCP > 0)
+                recvconsume(clients[i], retvalTCP); // Done looking at it
+            if(isGET) {
                 puts("Got GET request.");
-                char resp[sizeof(httpHeader) + 2] = {0};
-                strcpy(resp, httpHeader);
                 char contentLen[40];
-                sprintf(contentLen, "Content-Length: %d\r\n\r\n", sizeof(html));
-
-                uint16_t totalSize = strlen(resp) + strlen(contentLen) + sizeof(html);
-                if(totalSize % 2 != 0)
-                  totalSize += 1;
-                char sendBuf[totalSize + 2];
-                memset(sendBuf, 0, sizeof(sendBuf));
-                char *ptr = sendBuf;
-                memcpy(ptr, resp, strlen(resp));
-                ptr += strlen(resp);
-                memcpy(ptr, contentLen, strlen(contentLen));
-                ptr += strlen(contentLen);
-                memcpy(ptr, html, sizeof(html));
-
-                if(send(clients[i], sendBuf, totalSize, 0) < 0)
-                    puts("Send header failed");
+                sprintf(contentLen, "Content-Length: %u\r\n\r\n", (unsigned)sizeof(html));
+
+                // Header and page go out straight from where they are, without being put together first.
+                // Over TCP nothing can be queued after flash data until it is ACKed, so the page comes last.
+                const int16_t sent = sendv(clients[i], LAYERS({httpHeader, sizeof(httpHeader) - 1, LAYER_RAM},
+                                                                 {contentLen, strlen(contentLen), LAYER_RAM},
+                                                                 {html, sizeof(html), LAYER_FLASH}), 3, 0);
+                if(sent < (int16_t)(sizeof(httpHeader) - 1 + strlen(contentLen) + sizeof(html)))
+                    puts("Send failed");
                 puts("Just sent HTTP data");
                 closeStream(clients[i]); 
                 clients[i] = -1; // Free the spot in the array
@@ -145,6 +143,17 @@ static void addClient(const int8_t toAdd) {
   }
 }
 
+// Returns 1 if the len bytes recvpeek() filled the spans with start with str
+static uint8_t spansStartWith(const struct Layer spans[], uint16_t len, const char *str) {
+  for(uint8_t i = 0; len > 0 && *str != '\0'; len -= spans[i++].len) {
+    const char *const data = spans[i].data;
+    for(uint16_t j = 0; j < spans[i].len && *str != '\0'; j++, str++)
+      if(data[j] != *str)
+        return 0;
+  }
+  return *str == '\0';
+}
+
 // This function is called by printf as a stream handler
 static int write_char_helper(char var, FILE *stream) {
 	uart_putc(var);
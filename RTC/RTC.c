@@ -11,16 +11,21 @@
 #error "Invalid number of timers"
 #endif
 
+// Longest timer, RTCtimerDone() would see anything longer as already expired. It is still 68 years,
+// so a DHCP lease of 0xFFFFFFFF seconds (infinite in RFC 2131) is never renewed.
+#define RTC_TIMER_MAX 0x7FFFFFFFUL
+
 #define disableRTCint() (TIMSK2 = 0) // disable RTC interrupt
 #define enableRTCint() (TIMSK2 = 1 << TOIE2) // disable RTC interrupt
 
 struct Timer 
 {
 	uint8_t inUse;
-	uint32_t seconds;
+	uint32_t expires; // Value of uptime at which the timer is done
 };
 
 static struct Timer timers[MAX_TIMERS] = {0};
+static volatile uint32_t uptime = 0; // Seconds since RTCinit(), so the ISR doesn't have to touch every timer
 static int8_t timeZone = 0; // Start at UTC+0
 
 static uint8_t notLeap(uint16_t year);
@@ -123,7 +128,7 @@ int8_t RTCsetTimer(const uint32_t seconds)
 	{
 		if(!timers[i].inUse)
 		{
-			timers[i].seconds = seconds;
+			timers[i].expires = uptime + (seconds > RTC_TIMER_MAX ? RTC_TIMER_MAX : seconds);
 			timers[i].inUse = 1;
 			enableRTCint();
 			return i;
@@ -138,7 +143,7 @@ int8_t RTCtimerDone(const int8_t timer)
 {
 	disableRTCint();
 	if(timer < MAX_TIMERS && timer >= 0 && timers[timer].inUse) {
-		if(timers[timer].seconds == 0)
+		if((int32_t)(uptime - timers[timer].expires) >= 0)
 		{
 			timers[timer].inUse = 0; // When we read a zero timer, it releases the timer
 			enableRTCint();
@@ -159,7 +164,7 @@ int8_t RTCresetTimer(const int8_t timer, const uint32_t seconds)
 {
 	disableRTCint();
 	if(timer < MAX_TIMERS && timer >= 0 && timers[timer].inUse) {
-		timers[timer].seconds = seconds;
+		timers[timer].expires = uptime + (seconds > RTC_TIMER_MAX ? RTC_TIMER_MAX : seconds);
 		enableRTCint();
 		return 0;
 	}
@@ -170,11 +175,7 @@ int8_t RTCresetTimer(const int8_t timer, const uint32_t seconds)
 #ifdef RTC_FROM_TOSC
 ISR(TIMER2_OVF_vect)
 {
-	for(uint8_t i = 0; i < MAX_TIMERS; i++)
-	{
-		if(timers[i].inUse)
-			timers[i].seconds -= 1; // Decrement all active timers
-	}
+	uptime++; // Timers compare against this, so this ISR takes the same time no matter how many are active
 	#ifdef USE_UNIX_TIME
 	rtc.unix++;
 	#endif
@@ -8,6 +8,7 @@ extern "C" {
 This library provides two options for the source of the RTC. One is the DS3231 module
 and the other is the internal Timer 2 peripheral driven by a 32kHz external crystal.
 This option is chosen by commenting out the undesired macro below.
+The timers here count whole seconds, for anything shorter use the timer wheel in Timer/Timer.h.
 */
 
 #define MAX_TIMERS 30
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+#include "HeaderStructs/HeaderStructs.h"
+#include "ENC28J60_macros/ENC28J60_macros.h"
+#include "ENC28J60_functions/ENC28J60_functions.h"
+#include "Ring.h"
+
+#if (CHUNK_SIZE & (CHUNK_SIZE - 1)) || CHUNK_SIZE < 2
+#error "Chunk size not a power of two"
+#endif
+#if POOL_CHUNKS + NIC_CHUNKS > 255 || POOL_CHUNKS < 1
+#error "Invalid number of chunks"
+#endif
+#if NIC_POOL_ST + NIC_CHUNKS * CHUNK_SIZE > BUF_LEN
+#error "NIC chunks don't fit in the ENC28J60's buffer memory"
+#endif
+#if NIC_POOL_ST < TX_BUF_ST + 1 + 1518 + 7
+#error "NIC chunks overlap the TX frame"
+#endif
+
+#define CHUNK_BASE(index) ((index) & ~(uint32_t)(CHUNK_SIZE - 1)) // Index of the first byte of the chunk index is in
+#define IN_NIC(chunk) ((chunk) > POOL_CHUNKS)
+#define NIC_ADDRESS(chunk) (NIC_POOL_ST + ((chunk) - POOL_CHUNKS - 1) * CHUNK_SIZE) // Buffer memory address of a NIC chunk
+
+enum ChunkTier {TIER_RAM, TIER_NIC};
+
+uint8_t chunkPool[POOL_CHUNKS][CHUNK_SIZE];
+// Chunks are numbered from 1 so a zeroed table means no chunks, RAM chunks first and then NIC chunks.
+// Free chunks of each tier are a linked list, and chunks that were never used are handed out in order,
+// so nothing needs to be set up at startup.
+static uint8_t nextFree[POOL_CHUNKS + NIC_CHUNKS]; // Links of the free lists
+static uint8_t freeList[2] = {0};
+static uint8_t handedOut[2] = {0}; // How many chunks of each tier have been handed out at some point
+static uint8_t freeCount[2] = {POOL_CHUNKS, NIC_CHUNKS};
+static const uint8_t tierFirst[2] = {1, POOL_CHUNKS + 1};
+static const uint8_t tierSize[2] = {POOL_CHUNKS, NIC_CHUNKS};
+
+static uint8_t chunkAlloc(const enum ChunkTier tier);
+static void chunkFree(const uint8_t chunk);
+
+static uint8_t chunkAlloc(const enum ChunkTier tier) {
+	uint8_t chunk = 0; // This tier is empty
+	if(freeList[tier] != 0) {
+		chunk = freeList[tier];
+		freeList[tier] = nextFree[chunk - 1];
+	}
+	else if(handedOut[tier] < tierSize[tier])
+		chunk = tierFirst[tier] + handedOut[tier]++;
+	if(chunk != 0)
+		freeCount[tier]--;
+	return chunk;
+}
+
+static void chunkFree(const uint8_t chunk) {
+	const enum ChunkTier tier = IN_NIC(chunk) ? TIER_NIC : TIER_RAM;
+	nextFree[chunk - 1] = freeList[tier];
+	freeList[tier] = chunk;
+	freeCount[tier]++;
+}
+
+// Makes sure every chunk the bytes from start up to end fall in is there, taking new ones from the pool.
+// With nic set, chunks come from the ENC28J60's memory as long as it has any left, and from RAM after that.
+// Returns end, or if the pool ran out, how far from start the bytes can be written.
+uint32_t ringReserve(uint8_t chunks[], const uint32_t size, const uint32_t start, const uint32_t end, const uint8_t nic) {
+	if((int32_t)(end - start) <= 0)
+		return end; // Nothing to write, don't take the chunk start is in
+	for(uint32_t i = CHUNK_BASE(start); (int32_t)(i - end) < 0; i += CHUNK_SIZE) {
+		uint8_t *const chunk = &chunks[(i & (size - 1)) / CHUNK_SIZE];
+		if(*chunk == 0 && nic)
+			*chunk = chunkAlloc(TIER_NIC);
+		if(*chunk == 0 && (*chunk = chunkAlloc(TIER_RAM)) == 0)
+			return (int32_t)(i - start) < 0 ? start : i;
+	}
+	return end;
+}
+
+// Returns every chunk that holds none of the bytes from start up to end to the pool
+void ringTrim(uint8_t chunks[], const uint32_t size, const uint32_t start, const uint32_t end) {
+	const uint32_t base = CHUNK_BASE(start);
+	const uint32_t live = (int32_t)(end - start) > 0 ? end - base : 0; // From the start of the first chunk in use
+	for(uint32_t i = 0; i < size / CHUNK_SIZE; i++) {
+		// How far this chunk is from the first chunk in use, going forward around the ring
+		const uint32_t distance = (i * CHUNK_SIZE - base) & (size - 1);
+		if(chunks[i] != 0 && distance >= live) {
+			chunkFree(chunks[i]);
+			chunks[i] = 0;
+		}
+	}
+}
+
+// How many bytes from index could be written right now in RAM: the rest of its chunk if it has one, and all free RAM chunks.
+// The ring may have less room than this.
+uint32_t ringRoom(const uint8_t chunks[], const uint32_t size, const uint32_t index) {
+	const uint8_t chunk = chunks[(index & (size - 1)) / CHUNK_SIZE];
+	const uint32_t own = chunk != 0 && !IN_NIC(chunk) ? CHUNK_SIZE - (index & (CHUNK_SIZE - 1)) : 0;
+	return own + (uint32_t)freeCount[TIER_RAM] * CHUNK_SIZE;
+}
+
+// Copies len bytes from src into the ring at index, chunk by chunk. The chunks must have been reserved.
+void ringWrite(const uint8_t chunks[], const uint32_t size, uint32_t index, const void *const src, const uint16_t len) {
+	const uint8_t *from = src;
+	for(uint16_t done = 0; done < len;) {
+		const struct Layer span = ringSpan(chunks, size, index, len - done);
+		if(span.source == LAYER_NIC)
+			writeBufferAt((uintptr_t)span.data, from, span.len); // Over SPI, into the ENC28J60's memory
+		else
+			memcpy((void *)span.data, from, span.len);
+		from += span.len;
+		index += span.len;
+		done += span.len;
+	}
+}
+
+// Copies len bytes out of the ring from index into dest, chunk by chunk. The chunks must be in RAM.
+void ringRead(const uint8_t chunks[], const uint32_t size, uint32_t index, void *const dest, const uint16_t len) {
+	uint8_t *to = dest;
+	for(uint16_t done = 0; done < len;) {
+		const struct Layer span = ringSpan(chunks, size, index, len - done);
+		memcpy(to, span.data, span.len);
+		to += span.len;
+		index += span.len;
+		done += span.len;
+	}
+}
+
+// Splits len bytes of the ring from index into the pieces ringSpan() returns, at most maxSpans of them.
+// Returns how many it wrote into spans, which cover less than len if there weren't enough.
+uint8_t ringSpans(const uint8_t chunks[], const uint32_t size, uint32_t index, uint16_t len, struct Layer spans[], const uint8_t maxSpans) {
+	uint8_t count = 0;
+	for(; len > 0 && count < maxSpans; count++) {
+		spans[count] = ringSpan(chunks, size, index, len);
+		index += spans[count].len;
+		len -= spans[count].len;
+	}
+	return count;
+}
+
+// Returns the longest piece of the ring from index that is in one chunk, up to len bytes.
+// It can be given to sendIPv4packet() as is, for a NIC chunk the data goes from buffer memory into the frame by DMA.
+struct Layer ringSpan(const uint8_t chunks[], const uint32_t size, const uint32_t index, const uint16_t len) {
+	const uint8_t chunk = chunks[(index & (size - 1)) / CHUNK_SIZE];
+	const uint16_t offset = index & (CHUNK_SIZE - 1);
+	const uint16_t left = CHUNK_SIZE - offset; // Bytes to the end of this chunk
+	const uint16_t spanLen = len < left ? len : left;
+	if(IN_NIC(chunk))
+		return (struct Layer){(const void *)(uintptr_t)(NIC_ADDRESS(chunk) + offset), spanLen, LAYER_NIC};
+	return (struct Layer){&chunkPool[chunk - 1][offset], spanLen, LAYER_RAM};
+}
@@ -0,0 +1,46 @@
+#ifndef RING_H
+#define RING_H
+#ifdef __cplusplus
+#define restrict __restrict__
+extern "C" {
+#endif
+/*
+Storage for the stream ring buffers. Instead of every stream owning its whole RX and TX buffers, a ring is
+a table of chunk numbers, one per CHUNK_SIZE piece of the ring. Chunks come from a pool shared by all
+streams when data is written into that piece, and go back once nothing in the ring uses them anymore,
+so idle streams take no buffer memory at all.
+Ring indices work like before (free running, masked by the ring size), only the bytes live in chunks.
+The pool has two tiers: chunks in RAM, and chunks in the ENC28J60's spare buffer memory past the TX frame.
+NIC chunks can only be written with ringWrite() and sent with ringSpan(), so they suit TX rings,
+whose data is written once and then only sent and resent.
+Data is copied in and out a chunk at a time with memcpy(), so a copy is at most one memcpy() per chunk it touches.
+*/
+
+#define CHUNK_SIZE 128 // Bytes in each chunk, must be a power of two and no bigger than the stream buffers
+#define POOL_CHUNKS 32 // Chunks in RAM shared by the rings of all streams
+#define NIC_CHUNKS 16 // Chunks in the ENC28J60's memory from NIC_POOL_ST on, at most 255 chunks in total
+
+/*
+Usage of the functions, with uint8_t chunks[size / CHUNK_SIZE] = {0}:
+end = ringReserve(chunks, size, head, head + len, 0); // Bytes from head up to end can now be written
+ringWrite(chunks, size, head, src, end - head);
+ringRead(chunks, size, tail, dest, len); // Copies out without moving anything, the caller moves tail
+struct Layer span = ringSpan(chunks, size, tail, len); // Or looks at it where it is, up to the end of the chunk
+count = ringSpans(chunks, size, tail, len, spans, maxSpans); // Or at all of it, one span per chunk
+ringTrim(chunks, size, tail, head); // Frees chunks no longer holding anything between tail and head
+ringTrim(chunks, size, 0, 0); // Frees all of them
+*/
+
+extern uint8_t chunkPool[POOL_CHUNKS][CHUNK_SIZE];
+extern uint32_t ringReserve(uint8_t chunks[], const uint32_t size, const uint32_t start, const uint32_t end, const uint8_t nic);
+extern void ringTrim(uint8_t chunks[], const uint32_t size, const uint32_t start, const uint32_t end);
+extern uint32_t ringRoom(const uint8_t chunks[], const uint32_t size, const uint32_t index);
+extern void ringWrite(const uint8_t chunks[], const uint32_t size, uint32_t index, const void *const src, const uint16_t len);
+extern void ringRead(const uint8_t chunks[], const uint32_t size, uint32_t index, void *const dest, const uint16_t len);
+extern uint8_t ringSpans(const uint8_t chunks[], const uint32_t size, uint32_t index, uint16_t len, struct Layer spans[], const uint8_t maxSpans);
+extern struct Layer ringSpan(const uint8_t chunks[], const uint32_t size, const uint32_t index, const uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // RING_H
@@ -2,154 +2,285 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "HeaderStructs/HeaderStructs.h"
 #include "Checksum/Checksum.h"
-#include "RTC/RTC.h"
+#include "Timer/Timer.h"
+#include "ENC28J60_functions/ENC28J60_functions.h"
+#include "Ring/Ring.h"
 #include "WebserverDriver/WebserverDriver.h"
 #include "Socket.h"
 
-#define RETRANSMIT_PERIOD 5
+// Retransmission timeout limits in ms, see RFC 6298
+#define TCP_RTO_INITIAL 1000 // Used until the first RTT sample
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 60000
+#define TCP_RTT_MAX 4000 // RTT samples are capped here so the scaled srtt and rttvar fit in 16 bits
+#define TCP_MAX_RETRANSMITS 8 // Give up on the connection after resending a segment this many times
+#define TCP_MAX_SYN_RETRIES 5 // Resends of our SYN before connect() fails
+#define TCP_MAX_SYNACK_RETRIES 5 // Resends of our SYN-ACK before a half-open connection is dropped
+#define TCP_FIN_WAIT_2_MS 30000 // How long we wait for the peer's FIN after they ACKed ours
+
+#define TCP_DUPACK_THRESHOLD 3 // Duplicate ACKs that trigger a fast retransmit, RFC 5681 3.2
+#define TCP_DELACK_MS 100 // How long we may hold back an ACK hoping to piggyback it on data, RFC 1122 allows up to 500
+#define TCP_DEFAULT_MSS 536 // Standard MSS without options, used if the peer doesn't send one and advertised as ours
+#define TCP_MAX_MSS 1460 // What fits in the 1500 byte IP packets MAMXFL allows
+#define TCP_MIN_MSS 48 // Same floor as Linux, so a tiny advertised MSS can't make us send a flood of tiny segments
+#define TCP_MAX_OPTIONS 40 // Most option bytes a TCP header can hold
+#define TCP_MAX_WSCALE 14 // RFC 7323 2.3
+#define TCP_SYN_OPTIONS 20 // Most option bytes we put on a SYN or SYN-ACK
+#define TCP_TS_OPTION 12 // Timestamps option with two NOPs in front, to keep what follows 4-byte aligned
+// Window scale shift we offer, the smallest that lets our 16-bit window field cover the whole RX buffer
+#define TCP_RX_WSCALE (STREAM_RX_SIZE < (1UL << 16) ? 0 : STREAM_RX_SIZE < (1UL << 17) ? 1 : STREAM_RX_SIZE < (1UL << 18) ? 2 : \
+					   STREAM_RX_SIZE < (1UL << 19) ? 3 : STREAM_RX_SIZE < (1UL << 20) ? 4 : 5)
+// RFC 1122 4.2.3.3, the right edge of our window only moves in steps of our MSS or half the RX buffer
+#define TCP_RX_SWS_STEP (STREAM_RX_SIZE / 2 < TCP_DEFAULT_MSS ? STREAM_RX_SIZE / 2 : TCP_DEFAULT_MSS)
+// Nagle's algorithm treats a segment as full sized at the MSS, or at half our TX buffer if that is smaller,
+// since the user could never fill a whole MSS while anything is unACKed
+#define NAGLE_FULL_SIZE(mss) (STREAM_TX_SIZE / 2 < (mss) ? STREAM_TX_SIZE / 2 : (mss))
+
+// Most flash data one TCPsendProgmem() reference covers, so the TX indices stay in range
+#define TCP_PROGMEM_MAX (INDEX_REBASE < 0x4000U ? INDEX_REBASE : 0x4000U)
+// Most TX buffer chunks one segment can be spread over, it is never longer than the buffer or TCP_MAX_MSS
+#define TX_SEGMENT_SPANS ((STREAM_TX_SIZE < TCP_MAX_MSS ? STREAM_TX_SIZE / CHUNK_SIZE : (TCP_MAX_MSS + CHUNK_SIZE - 1) / CHUNK_SIZE) + 1)
+
+#define SEGMENT(s, i) (&(s)->tcb.segs[((s)->tcb.segFirst + (i)) & (TX_SEGMENTS - 1)])
+
+// What the peer's SYN or SYN-ACK told us
+struct SYNoptions {
+	uint16_t mss; // Their MSS, clamped, or the default if they didn't send one
+	uint8_t scale; // What their window field is shifted left by
+	uint32_t tsVal; // Their timestamp, if they sent the timestamps option
+	uint8_t sackPermitted : 1,
+			windowScaling : 1,
+			timestamps : 1;
+};
+
+// A connection to a listening socket that we sent a SYN-ACK for, but that hasn't been ACKed yet.
+// This is all we keep until the handshake is done, so a burst of SYNs can't take up the streams.
+struct HalfOpen {
+	struct WheelTimer timer; // Resends our SYN-ACK
+	struct IPv4 remoteIP;
+	uint16_t remotePort;
+	uint16_t window; // Their window from the SYN
+	uint32_t iss; // Raw sequence number of our SYN-ACK
+	uint32_t irs; // Raw sequence number of their SYN
+	uint16_t rto;
+	struct SYNoptions options;
+	int8_t parent; // Index of the listening socket
+	uint8_t retries : 7, // How many times our SYN-ACK was resent
+			inUse : 1;
+};
+
+// A connection in TIME_WAIT, which no longer needs a stream. We just ACK whatever they still send.
+struct TimeWait {
+	struct IPv4 remoteIP;
+	uint16_t remotePort;
+	uint16_t localPort;
+	uint32_t sndNext; // Raw sequence number right after our FIN
+	uint32_t rcvNext; // Raw sequence number right after their FIN
+	uint32_t expires; // now_ms() at which TIME_WAIT is over
+	uint32_t tsRecent; // Their last timestamp, our ACKs still have to echo it
+	uint8_t inUse : 1,
+			timestamps : 1;
+};
 
 struct Socket sockets[MAX_SOCKETS] = {0}; // Where we store our socket descriptors
 struct Stream streams[MAX_STREAMS] = {0}; // Our pool of streams that sockets can acquire
+static struct HalfOpen halfOpen[MAX_HALF_OPEN] = {0}; // Connections to listening sockets in the middle of the handshake
+static struct TimeWait timeWait[MAX_TIME_WAIT] = {0}; // Closed connections in TIME_WAIT
+
+// This struct allows us to easily read and write the big-endian edges of a SACK option block
+struct __attribute__((packed, scalar_storage_order("big-endian"))) SACKedge {
+	uint32_t left;
+	uint32_t right;
+};
+
+// The values of a timestamps option (RFC 7323), which follow its kind and length bytes
+struct __attribute__((packed, scalar_storage_order("big-endian"))) Timestamps {
+	uint32_t val; // Sender's clock when the segment was sent
+	uint32_t ecr; // The most recent timestamp the sender received from us, echoed back
+};
 
-static const void *getTCPoption(const uint8_t *const options, const uint8_t num);
+static const void *getTCPoption(const struct TCPheader *const tcp, const uint8_t num);
 static uint16_t TCPchecksum(const struct IPv4 *const restrict destIP, const struct TCPheader *const restrict tcp, 
-							const uint8_t options[], const uint8_t optionsLen, const uint8_t data[], const uint16_t dataLen);
-static void sendWhatWeCan(const int8_t stream);
-static void sendTCPpacket(const struct Stream *const restrict stream, const uint32_t seq, const uint32_t ack, 
-	const uint16_t flags, const uint8_t options[], const uint8_t optionsLen, const uint8_t data[], const uint16_t dataLen);
+							const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]);
+static void receivePayload(struct Stream *const restrict s, const struct TCPheader *const restrict tcp, const uint16_t payloadLen);
+static void processACK(struct Stream *const restrict s, const struct TCPheader *const restrict tcp, const uint16_t payloadLen);
+static void congestionACK(struct Stream *const s, const uint32_t acked, const uint32_t flight);
+static void congestionLoss(struct Stream *const s, const uint32_t flight);
+static uint8_t addSACKblock(struct SACKblock blocks[], uint8_t *const count, uint32_t start, uint32_t end);
+static void removeSACKblock(struct SACKblock blocks[], uint8_t *const count, const uint8_t index);
+static uint8_t buildSACKoption(const struct Stream *const s, uint8_t option[], const uint8_t room);
+static uint16_t segmentSize(const struct Stream *const s);
+static void sendSegment(struct Stream *const s, const struct TXsegment *const seg);
+static void initTCB(struct Stream *const s);
+static void parseSYNoptions(const struct TCPheader *const restrict tcp, struct SYNoptions *const restrict options);
+static void applySYNoptions(struct Stream *const restrict s, const struct SYNoptions *const restrict options);
+static uint8_t buildSYNoptions(uint8_t options[TCP_SYN_OPTIONS], const uint8_t sackPermitted, const uint8_t windowScaling,
+	const uint8_t timestamps, const uint32_t tsEcr);
+static uint8_t buildTSoption(uint8_t option[TCP_TS_OPTION], const uint32_t tsEcr);
+static uint8_t checkTimestamp(struct Stream *const restrict s, const struct TCPheader *const restrict tcp);
+static void sendSYNACK(struct HalfOpen *const h);
+static void halfOpenExpired(void *const arg);
+static void releaseHalfOpen(struct HalfOpen *const h);
+static void enterTimeWait(struct Stream *const s);
+static uint8_t timeWaitActive(const struct TimeWait *const t, const uint32_t now);
+static void ackSegments(struct Stream *const s, int32_t rtt);
+static void updateRTO(struct TCB *const tcb, uint16_t rtt);
+static uint8_t segmentSACKed(const struct Stream *const s, const struct TXsegment *const seg);
+static void retransmitLost(struct Stream *const s);
+static void sendWhatWeCan(const int8_t stream, const uint8_t flush);
+static void TCPtimerExpired(void *const arg);
+static void TCPdelayedACK(void *const arg);
+static uint32_t rcvNext(const struct Stream *const s);
+static int16_t waitForData(struct Stream *const s, const uint8_t flags);
+static RING_INDEX txRingEnd(const struct Stream *const s);
+static uint16_t queueData(struct Stream *const s, const void *const src, const uint16_t len);
+static uint16_t queueProgmem(struct Stream *const s, const void *const src, const uint16_t len);
+static uint32_t rxEnd(const struct Stream *const s);
+static void rebaseRX(struct Stream *const s);
+static void rebaseTX(struct Stream *const s);
+static void releaseStream(struct Stream *const s);
+static uint16_t advertisedWindow(struct Stream *const s, const uint16_t flags);
+static void sendTCPpacket(struct Stream *const restrict stream, const uint32_t seq, const uint32_t ack, 
+	const uint16_t flags, const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]);
+static void sendTCPsegment(const struct IPv4 *const restrict dest, const uint16_t srcPort, const uint16_t destPort,
+	const uint32_t seq, const uint32_t ack, const uint16_t flags, const uint16_t window,
+	const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]);
+static uint16_t checksumSpan(const uint16_t context, const struct Layer *const span, const uint8_t oddOffset);
 
 // Main state machine: http://www.tcpipguide.com/free/t_TCPOperationalOverviewandtheTCPFiniteStateMachineF-2.htm
 // http://www.tcpipguide.com/free/t_TCPConnectionManagementandProblemHandlingtheConnec-2.htm
 // On wireshark, when I click a link on the website, sends syn etc, then content, then server closes the connection
-// It does send RST when receives SYN for port with no listener
 // If one end sends FIN, it can still receive residual data from other end, can send data in FIN segment
 // From FIN_WAIT_1, if it receives FIN ACK it goes to TIME_WAIT
 
 // Standard MSS without options is 536 bytes
-// TCP todo:
-// Add separate retransmit timers for each TCP segment
-// Allow receiving TCP frames out of order
 
 void TCPprocessor(struct Stream *const restrict stream, const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp) {
 	printf("TCPprocessor state = %u, flags = 0x%02X\n", stream->state, tcp->flags);
+	const uint16_t payloadLen = ip->length - ip->iht * 4 - tcp->offset * 4; 
+	if(stream->timestamps && !checkTimestamp(stream, tcp))
+		return; // An old duplicate
 	switch(stream->state) {
 		case CLOSED:
+		case LISTEN: // SYNs for listening sockets are handled by TCPlisten(), before there is a stream
 			break;
-		case LISTEN: // Expecting SYN, send SYN_ACK
-			//printf("Case LISTEN, flags = %x\n", tcp->flags);
-			if(tcp->flags & SYN) {
-				puts("Got SYN packet");
-				stream->tx.window = tcp->window; // For now before window scaling
-				const uint8_t *const scale = getTCPoption((uint8_t *)tcp + sizeof(struct TCPheader), 3); // Process window scaling option
-				if(scale == NULL)
-					stream->tx.scale = 1;
-				else
-					stream->tx.scale = 1 << scale[1];
-				puts("Processed options");
-				stream->tx.next = 0; // This is not initialized by incomingPacket()
-				const uint8_t options[] = {2, 4, 536 >> 8, 536 & 0xFF, // MSS option
-											1, 1, 1, 0}; // End of options, must make size a multiple of 4
-				stream->tx.rawseq = rand();
-				stream->rx.rawseq = tcp->seq; // Temporarily set our RX zero point
-
-				sendTCPpacket(stream, 0, 1, SYN | ACK, options, sizeof(options), NULL, 0);
-
-				stream->tx.rawseq += 1; // Account for phantom byte when setting our TX zero point
-				stream->state = SYN_RECEIVED;
-				// We don't need to worry about the transmit window since we are only sending a phantom byte
-				//printf("SYN-ACK from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u\n", localIP.addr[0], localIP.addr[1], localIP.addr[2], localIP.addr[3],
-				//		resp.srcPort, stream->remoteIP.addr[0], stream->remoteIP.addr[1], stream->remoteIP.addr[2], stream->remoteIP.addr[3], resp.destPort);
-			}
-			break; // else drop the packet
-		case SYN_RECEIVED: // Expecting an ACK, then no further action
-			if(tcp->flags == ACK) {
-				stream->rx.rawseq += 1; // Set RX zero point to right past phantom byte
-				stream->state = ESTABLISHED;
-				puts("Stream established");
-			}
-			else if(tcp->flags & RST)
-				stream->state = LISTEN;
-			break;
+		case SYN_RECEIVED: // TCPlisten() just promoted this connection on the ACK of our SYN-ACK
+			stream->state = ESTABLISHED;
+			puts("Stream established");
+			// Fall through, if the last ACK of the handshake was lost this is their first data segment
 		case ESTABLISHED: // These are the three states in which we can receive data
 		case FIN_WAIT_1:
 		case FIN_WAIT_2: {
 			if(tcp->flags & RST) {
-				stream->state = CLOSED;
+				if(stream->state == ESTABLISHED)
+					stream->state = CLOSED; // The user sees this on their next recv() or send(), then closes it
+				else
+					releaseStream(stream); // The user already closed this stream
 				break;
 			}
-			const uint16_t payloadLen = ip->length - ip->iht * 4 - tcp->offset * 4; 
 			printf("Est payload = %u\n", payloadLen);
-			if(STREAM_RX_SIZE - (stream->rx.head - stream->rx.tail) >= payloadLen && payloadLen > 0) { // Do we have room for this payload?
-				if(tcp->seq - stream->rx.rawseq == stream->rx.head) { // Is this payload contiguous with any previous payloads?
-					const uint8_t *const restrict payload = (uint8_t *)tcp + tcp->offset * 4;
-					for(uint16_t i = 0; i < payloadLen; i++)
-						stream->rx.buf[stream->rx.head++ & RX_MASK] = payload[i]; // Write in this data
-					// Send ACK packet 
-					const uint8_t options[] = {1, 1, 1, 0};
-					sendTCPpacket(stream, stream->tx.next, stream->rx.head, ACK, options, sizeof(options), NULL, 0); 
-					puts("Est sent ACK");
-				} // A proper implementation would allow receiving discontiguous received payloads and selective acknowledgement
+			if(payloadLen > 0) {
+				const uint32_t prevHead = stream->rx.head;
+				const uint8_t hadHoles = stream->tcb.oooCount > 0;
+				receivePayload(stream, tcp, payloadLen); // Writes in-order and out-of-order data into the RX buffer
+				// RFC 5681 4.2, ACK right away if this segment was out of order or filled a hole, and for every second segment.
+				// Otherwise wait a little, since the user will probably send a response we can put the ACK on.
+				// Even "right away" waits until packetHandler() has drained the NIC, so a burst gets one cumulative ACK.
+				if(stream->rx.head == prevHead || hadHoles || stream->ackPending)
+					stream->ackNow = 1; // The ACK will also carry SACK blocks if there are holes in what we received
 				else {
-					puts("Not contiguous");
+					stream->ackPending = 1;
+					timerArm(&stream->ackTimer, TCP_DELACK_MS);
 				}
 			}
-			stream->tx.window = stream->tx.scale * tcp->window; // Update our send window
-			stream->tx.tail = tcp->ack - stream->tx.rawseq; // Move tail to after last ACKed byte
+			else if(tcp->seq - stream->rx.rawseq != stream->rx.head)
+				stream->ackNow = 1; // An empty segment not at rcvNext, like a zero window probe, is unacceptable and gets an ACK (RFC 793)
+			processACK(stream, tcp, payloadLen); // Update send window, tail and SACK scoreboard
+			if(stream->state != FIN_WAIT_2)
+				sendWhatWeCan(stream - streams, 0); // Their ACK may let out data Nagle or the window was holding back
 
 			// Have we received a FIN frame and we have ACKed all their data up to FIN?
-			if(tcp->flags & FIN && tcp->seq == stream->rx.head + stream->rx.rawseq) {
-				// Send ACK to their FIN here
-				sendTCPpacket(stream, stream->tx.next, stream->rx.head + 1, ACK, NULL, 0, NULL, 0);
+			if(tcp->flags & FIN && tcp->seq + payloadLen == stream->rx.head + stream->rx.rawseq) {
+				stream->ackNow = 1; // ACK their FIN, rcvNext() counts it once the state below changes
 				switch(stream->state) { // Sorry for a nested switch here
 					case ESTABLISHED:
 						stream->state = CLOSE_WAIT; // Now we wait for user to call closeStream()
 						break;
 					case FIN_WAIT_1:
-						if(stream->tx.tail > stream->tx.next) { // If our FIN was also ACKed with this packet (also see if() below)
-							stream->state = TIME_WAIT; // All done, just wait for all packets to get through now
-							stream->timer = RTCsetTimer(TIME_WAIT_SECONDS);
-						}
+						if(stream->tx.tail > stream->tx.head) // If our FIN was also ACKed with this packet (also see if() below)
+							enterTimeWait(stream); // All done, just wait for all packets to get through now
 						else
 							stream->state = CLOSING; // Wait for them to ACK our FIN
 						break;
 					case FIN_WAIT_2:
-						stream->state = TIME_WAIT; // All done, just wait for all packets to get through now
-						stream->timer = RTCsetTimer(TIME_WAIT_SECONDS);
+						enterTimeWait(stream); // All done, just wait for all packets to get through now
 						break;
 					default: // Never reaches here
 						break;
 				}
 			}
-			// This if-statement assumes that when user calls closeStream() it does not increment tx.next with phantom byte
-			else if(stream->state == FIN_WAIT_1 && stream->tx.tail > stream->tx.next) // If we received an ACK for our FIN
+			// Our FIN is the phantom byte right after the data, so ACKing it moves tail past head
+			else if(stream->state == FIN_WAIT_1 && stream->tx.tail > stream->tx.head) { // If we received an ACK for our FIN
 				stream->state = FIN_WAIT_2; // Now wait for their FIN
+				timerArm(&stream->timer, TCP_FIN_WAIT_2_MS); // But not forever, the user has already let go of this stream
+			}
 			break;
 		}
 		case LAST_ACK: // In these two states we are just waiting for them to ACK our FIN
 		case CLOSING:
+			if(tcp->flags & RST) {
+				releaseStream(stream); // Free this stream
+				break;
+			}
+			if(tcp->flags & FIN)
+				stream->ackNow = 1; // They resent their FIN, so our ACK of it was lost
+			processACK(stream, tcp, payloadLen); // Move tail to after last ACKed byte
+			sendWhatWeCan(stream - streams, 1); // Data still in the TX buffer and our FIN go out as the window allows
+			if((tcp->flags & ACK) && stream->tx.tail > stream->tx.head) { // They ACKed our FIN
+				if(stream->state == LAST_ACK)
+					releaseStream(stream); // Free this stream
+				else // CLOSING
+					enterTimeWait(stream);
+			}
+			break;
+		case CLOSE_WAIT: // They sent their FIN, but we can still send data and need their ACKs for it
 			if(tcp->flags & RST) {
 				stream->state = CLOSED;
-				stream->inUse = 0; // Free this stream
 				break;
 			}
-			stream->tx.tail = tcp->ack - stream->tx.rawseq; // Move tail to after last ACKed byte
-			if((tcp->flags & ACK) && stream->tx.tail > stream->tx.next) { // They ACKed our FIN
-				if(stream->state == LAST_ACK) {
-					stream->state = CLOSED;
-					stream->inUse = 0; // Free this stream
-				}
-				else { // CLOSING
-					stream->state = TIME_WAIT;
-					stream->timer = RTCsetTimer(TIME_WAIT_SECONDS);
+			processACK(stream, tcp, payloadLen);
+			sendWhatWeCan(stream - streams, 0);
+			break;
+		case SYN_SENT: // We sent a SYN from connect(), expecting their SYN-ACK
+			if((tcp->flags & ACK) && tcp->ack != stream->tx.rawseq) {
+				TCPreset(ip, tcp); // Not an ACK of our SYN, maybe from an old connection
+				break;
+			}
+			if(tcp->flags & RST) {
+				if(tcp->flags & ACK) {
+					timerCancel(&stream->timer);
+					stream->state = CLOSED; // Connection refused, connected() reports the failure
 				}
+				break;
+			}
+			if((tcp->flags & (SYN | ACK)) == (SYN | ACK)) { // We don't support simultaneous open, where a bare SYN arrives
+				struct SYNoptions options;
+				parseSYNoptions(tcp, &options);
+				applySYNoptions(stream, &options);
+				stream->tx.window = tcp->window; // The window in a SYN is never scaled
+				stream->rx.rawseq = tcp->seq + 1;
+				stream->tcb.rto = TCP_RTO_INITIAL; // Drop any backoff from resending the SYN
+				stream->retries = 0; // Now counts window probes
+				timerCancel(&stream->timer);
+				stream->state = ESTABLISHED;
+				stream->ackNow = 1; // The last ACK of the handshake goes out at the end of this packetHandler() batch
+				puts("Stream connected");
 			}
 			break;
-		case SYN_SENT: // TCP active open (i.e. sending SYN) not currently supported
-		case CLOSE_WAIT: // We do not expect to receive packets in these states
-		case TIME_WAIT:
-		default:
+		default: // We do not expect to receive packets in these states
 			if(tcp->flags & RST)
 				stream->state = CLOSED;
 	}
@@ -158,23 +289,55 @@ void TCPprocessor(struct Stream *const restrict stream, const struct IPv4header
 // This function will not be called by the user directly
 int16_t TCPrecv(const int8_t stream, void *const dest, const int16_t buflen, const uint8_t flags) {
 	struct Stream *const s = &streams[stream];
-	while(1) {
-		if(s->rx.head != s->rx.tail) { // Is there data waiting
-			int16_t length = s->rx.head - s->rx.tail;
-			for(int16_t i = 0; i < length; i++) {
-				if(i < buflen)
-					((uint8_t *)dest)[i] = s->rx.buf[s->rx.tail++ & RX_MASK];
-				else
-					break; // From for-loop
-			}
+	const int16_t length = waitForData(s, flags);
+	if(length <= 0)
+		return length;
+	const int16_t copied = buflen > length ? length : buflen; // We write to user the minimum of these
+	ringRead(s->rx.chunks, STREAM_RX_SIZE, s->rx.tail, dest, copied);
+	TCPconsume(stream, copied);
+	return copied;
+}
 
-			return buflen > length ? length : buflen; // We wrote to user the minimum of these
-		}
+// Like TCPrecv(), but fills spans with where the waiting data is in the RX buffer instead of copying it.
+// Returns how many bytes the spans cover, which is less than what is waiting if maxSpans pieces don't cover it.
+int16_t TCPpeek(const int8_t stream, struct Layer spans[], const uint8_t maxSpans, const uint8_t flags) {
+	struct Stream *const s = &streams[stream];
+	const int16_t length = waitForData(s, flags);
+	if(length <= 0)
+		return length;
+	int16_t covered = 0;
+	const uint8_t count = ringSpans(s->rx.chunks, STREAM_RX_SIZE, s->rx.tail, length, spans, maxSpans);
+	for(uint8_t i = 0; i < count; i++)
+		covered += spans[i].len;
+	return covered;
+}
+
+// Frees len bytes at the front of the RX buffer, after they were read or peeked at
+void TCPconsume(const int8_t stream, uint16_t len) {
+	struct Stream *const s = &streams[stream];
+	if(len > (RING_INDEX)(s->rx.head - s->rx.tail))
+		len = s->rx.head - s->rx.tail;
+	s->rx.tail += len;
+	ringTrim(s->rx.chunks, STREAM_RX_SIZE, s->rx.tail, rxEnd(s)); // Chunks we read all of go back to the pool
+	// If the window we offered is nearly used up and this made room for a worthwhile step, tell them now.
+	// They may be waiting on a zero window and would otherwise only find out from their persist timer.
+	if((s->state == ESTABLISHED || s->state == FIN_WAIT_1 || s->state == FIN_WAIT_2)
+		&& (RING_INDEX)(s->tcb.windowEnd - s->rx.head) < TCP_RX_SWS_STEP && s->rx.tail + STREAM_RX_SIZE - s->tcb.windowEnd >= TCP_RX_SWS_STEP)
+		sendTCPpacket(s, s->tx.next, rcvNext(s), ACK, NULL, 0, 0, NULL);
+	rebaseRX(s);
+}
+
+// Returns how many bytes are waiting in the RX buffer, or 0 if the other end sent FIN and there are none.
+// Processes packets until there are, unless flags has MSG_DONTWAIT, then returns -1 (EWOULDBLOCK).
+static int16_t waitForData(struct Stream *const s, const uint8_t flags) {
+	while(1) {
+		if(s->rx.head != s->rx.tail) // Is there data waiting
+			return s->rx.head - s->rx.tail;
 		// The following three states are the only ones in which we can still receive data
 		else if(!(s->state == ESTABLISHED || s->state == FIN_WAIT_1 || s->state == FIN_WAIT_2)) 
-			return 0; // Return 0 if other end sent FIN and there is no more data waiting
+			return 0;
 		else if(flags & MSG_DONTWAIT)
-			return -1; // return EWOULDBLOCK
+			return -1;
 		else
 			packetHandler(); // Process more packets before checking streams again
 	}
@@ -184,93 +347,980 @@ int16_t TCPrecv(const int8_t stream, void *const dest, const int16_t buflen, con
 int16_t TCPsend(const int8_t stream, const void *const src, const int16_t buflen, const uint8_t flags) {
 	struct Stream *const s = &streams[stream];
 	if(s->state == ESTABLISHED || s->state == CLOSE_WAIT) { // These are the only states we can send data from
-		int16_t room = STREAM_TX_SIZE - (s->tx.head - s->tx.tail); // Available space in TX buffer
-		for(int16_t i = 0; i < room; i++) {
-			if(i < buflen)
-				s->tx.buf[s->tx.head++ & TX_MASK] = ((uint8_t *)src)[i];
-			else
-				break; // From for-loop
-		}
+		const int16_t written = queueData(s, src, buflen < 0 ? 0 : buflen);
 		// At this point we have written all the data we can into the TX buffer, now we need to send some of it
-		sendWhatWeCan(stream);
-		return buflen > room ? room : buflen; // Return how much we wrote into TX buffer, not how much we actually sent
+		sendWhatWeCan(stream, 0);
+		return written; // Return how much we wrote into TX buffer, not how much we actually sent
 	}
 	else
 		return -1; // This stream is not in a sendable state
 }
 
+// Sends len bytes from flash without copying them anywhere. Segments read them from flash as they go out,
+// and again for every retransmission, so only where they are is remembered. Once a reference is made,
+// nothing else can be sent until it is all ACKed. More than TCP_PROGMEM_MAX bytes take several references,
+// this waits for each to be ACKed before making the next unless flags has MSG_DONTWAIT.
+// src must be in the low 64 KB of flash, which pgm_read_byte() reaches. Returns how many bytes were referenced,
+// or -1 if none could be or len is negative.
+int16_t TCPsendProgmem(const int8_t stream, const void *const src, const int16_t len, const uint8_t flags) {
+	if(len < 0)
+		return -1;
+	struct Stream *const s = &streams[stream];
+	int16_t done = 0;
+	while(done < len && (s->state == ESTABLISHED || s->state == CLOSE_WAIT)) {
+		const uint16_t queued = queueProgmem(s, (const uint8_t *)src + done, len - done);
+		if(queued == 0) { // The last reference is still in use
+			if(flags & MSG_DONTWAIT)
+				break;
+			packetHandler(); // Process more packets until it is ACKed
+			continue;
+		}
+		done += queued;
+		sendWhatWeCan(stream, 0);
+	}
+	return done > 0 ? done : -1;
+}
+
+// Queues the layers one after the other, RAM data is copied into the TX buffer and flash data is referenced
+// like TCPsendProgmem() does. Nothing is sent until all of them are queued, so they can share segments.
+// Stops at the first layer that doesn't fit whole and never waits, like TCPsend(). Returns how many bytes were queued.
+int16_t TCPsendv(const int8_t stream, const struct Layer layers[], const uint8_t num, const uint8_t flags) {
+	(void)flags; // Never waits, so MSG_DONTWAIT changes nothing
+	struct Stream *const s = &streams[stream];
+	if(!(s->state == ESTABLISHED || s->state == CLOSE_WAIT))
+		return -1; // This stream is not in a sendable state
+	int16_t total = 0;
+	for(uint8_t i = 0; i < num; i++) {
+		if(layers[i].source == LAYER_NIC)
+			break; // Only the TX buffer itself keeps data in the ENC28J60
+		const uint16_t queued = layers[i].source == LAYER_FLASH ? queueProgmem(s, layers[i].data, layers[i].len)
+																 : queueData(s, layers[i].data, layers[i].len);
+		total += queued;
+		if(queued < layers[i].len)
+			break;
+	}
+	sendWhatWeCan(stream, 0);
+	return total;
+}
+
+// Copies as much of len bytes as fits into the TX buffer, without sending anything. Returns how much that was.
+static uint16_t queueData(struct Stream *const s, const void *const src, const uint16_t len) {
+	// Available space in TX buffer. Its data can't come after flash data, so there is none until that is ACKed.
+	const uint32_t room = s->tcb.progmemLen > 0 ? 0 : STREAM_TX_SIZE - (s->tx.head - s->tx.tail);
+	const uint16_t wanted = len > room ? room : len;
+	// Less if the chunk pool is running low, what other streams get ACKed frees more.
+	// Data waiting to be sent or ACKed is only read to send it, so it goes in the ENC28J60's memory if there is room.
+	const uint32_t end = ringReserve(s->tx.chunks, STREAM_TX_SIZE, s->tx.head, s->tx.head + wanted, 1);
+	const uint16_t written = end - s->tx.head;
+	ringWrite(s->tx.chunks, STREAM_TX_SIZE, s->tx.head, src, written);
+	s->tx.head = end;
+	return written;
+}
+
+// Queues up to TCP_PROGMEM_MAX of len bytes of flash data by reference, after what is already queued.
+// Returns how many bytes that was, 0 if the last reference is still in use.
+static uint16_t queueProgmem(struct Stream *const s, const void *const src, const uint16_t len) {
+	if(s->tcb.progmemLen > 0)
+		return 0;
+	const uint16_t piece = len > TCP_PROGMEM_MAX ? TCP_PROGMEM_MAX : len;
+	s->tcb.progmem = src;
+	s->tcb.progmemStart = s->tx.head;
+	s->tcb.progmemLen = piece;
+	s->tx.head += piece;
+	return piece;
+}
+
 void TCPclose(const int8_t stream) {
 	struct Stream *const s = &streams[stream];
 	switch(s->state) {
 		// It only makes sense to call close in the following states
 		case ESTABLISHED:
 		case CLOSE_WAIT:
-			sendTCPpacket(s, s->tx.next, s->rx.head, FIN | ACK, NULL, 0, NULL, 0);
-			// We arbitrarily decide to not increment tx.next here despite sending a phantom byte
 			if(s->state == ESTABLISHED)
 				s->state = FIN_WAIT_1; // Wait for them to ACK our FIN before they send their own FIN
 			else // CLOSE_WAIT
 				s->state = LAST_ACK; // Wait for them to ACK our FIN (they already sent their FIN)
+			// Our FIN goes out on the segment with the last of the data in the TX buffer, which may be right now
+			s->finPending = 1;
+			sendWhatWeCan(stream, 1);
+			break;
+		case FIN_WAIT_1: // Already closing, the stream frees itself when that is done
+		case FIN_WAIT_2:
+		case CLOSING:
+		case LAST_ACK:
 			break;
 		default:
-			s->state = CLOSED; // Strictly speaking unnecessary to set this
-			s->inUse = 0; // Free this stream
+			releaseStream(s); // Free this stream
 			break;
 	}
 }
 
-static void sendWhatWeCan(const int8_t stream) {
+// Starts an active open on a stream connect() has set up: sends our SYN and moves to SYN_SENT
+void TCPconnect(const int8_t stream) {
 	struct Stream *const s = &streams[stream];
-	const uint16_t ableToSend = s->tx.tail + s->tx.window < s->tx.head ? 
-						  		s->tx.tail + s->tx.window - s->tx.next :
-						  		s->tx.head - s->tx.next; // Calculate how much we can send based on send window
-	if(ableToSend > 0) { // This means we will even send 1-byte payloads, which is very inefficient
-		uint8_t temp[ableToSend]; // Make temp buffer to straighten out circular buffer
-		const uint32_t prevNext = s->tx.next;
-		for(uint16_t i = 0; i < ableToSend; i++)
-			temp[i] = s->tx.buf[s->tx.next++ & TX_MASK]; // Copy what we'll send in this packet to temp
-		sendTCPpacket(s, prevNext, s->rx.head, ACK, NULL, 0, temp, ableToSend);
-		RTCresetTimer(s->timer, RETRANSMIT_PERIOD); // After every sent data frame, reset retransmission timer
-	}
-}
-
-static void sendTCPpacket(const struct Stream *const restrict stream, const uint32_t seq, const uint32_t ack, 
-	const uint16_t flags, const uint8_t options[], const uint8_t optionsLen, const uint8_t data[], const uint16_t dataLen) {
-	struct TCPheader pkt = {.srcPort = sockets[stream->parent].port, 
-							.destPort = stream->remotePort,
-							.seq = seq + stream->tx.rawseq, .ack = ack + stream->rx.rawseq,  
+	initTCB(s);
+	s->tx.rawseq = rand() + 1; // Our TX zero point is right past the phantom byte of our SYN
+	s->rx.rawseq = 0; // Set once their SYN-ACK arrives
+	s->state = SYN_SENT;
+	uint8_t options[TCP_SYN_OPTIONS];
+	sendTCPpacket(s, -1, 0, SYN, options, buildSYNoptions(options, 1, 1, 1, 0), 0, NULL); // Offer everything we support
+	timerArm(&s->timer, s->tcb.rto); // Resend it if no SYN-ACK comes back
+}
+
+// Handles a segment for a listening socket that doesn't belong to any stream. A SYN only gets a compact half-open
+// entry, and a full stream is taken from the pool when the ACK of our SYN-ACK completes the handshake.
+void TCPlisten(const int8_t socket, const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp) {
+	struct HalfOpen *h = NULL;
+	struct HalfOpen *unused = NULL;
+	uint8_t pending = 0; // Half-open connections this socket already has
+	for(uint8_t i = 0; i < MAX_HALF_OPEN; i++) {
+		if(!halfOpen[i].inUse) {
+			if(unused == NULL)
+				unused = &halfOpen[i];
+		}
+		else if(halfOpen[i].parent == socket) {
+			pending++;
+			if(halfOpen[i].remotePort == tcp->srcPort && memcmp(&halfOpen[i].remoteIP, &ip->srcIP, sizeof(struct IPv4)) == 0)
+				h = &halfOpen[i];
+		}
+	}
+	if(h == NULL) {
+		if(tcp->flags & ACK) {
+			TCPreset(ip, tcp); // Nothing here to ACK, maybe a connection we already dropped
+			return;
+		}
+		if((tcp->flags & (SYN | RST)) != SYN)
+			return; // Only a SYN can start a connection
+		if(unused == NULL || pending >= sockets[socket].backlog) {
+			puts("SYN backlog full");
+			return; // Drop it, they will resend the SYN
+		}
+		puts("Got SYN packet");
+		h = unused;
+		h->parent = socket;
+		h->remoteIP = ip->srcIP;
+		h->remotePort = tcp->srcPort;
+		h->window = tcp->window;
+		h->iss = rand();
+		h->irs = tcp->seq;
+		h->rto = TCP_RTO_INITIAL;
+		h->retries = 0;
+		parseSYNoptions(tcp, &h->options);
+		timerSetup(&h->timer, halfOpenExpired, h);
+		h->inUse = 1;
+		sendSYNACK(h);
+	}
+	else if(tcp->flags & RST)
+		releaseHalfOpen(h);
+	else if(tcp->flags & SYN) { // They resent their SYN, so our SYN-ACK was lost
+		if(tcp->seq == h->irs)
+			sendSYNACK(h);
+	}
+	else if((tcp->flags & ACK) && tcp->ack == h->iss + 1) { // The handshake is done, now it needs a stream
+		for(uint8_t i = 0; i < MAX_STREAMS; i++) {
+			struct Stream *const s = &streams[i];
+			if(!s->inUse) { // Look for an unused stream
+				s->parent = socket; // Set this stream's parent so accept() can find it
+				s->localPort = sockets[socket].port;
+				s->remotePort = h->remotePort;
+				s->remoteIP = h->remoteIP;
+				s->rx.head = 0;
+				s->rx.tail = 0;
+				s->tx.head = 0;
+				s->tx.tail = 0; // Clear out ring buffers
+				initTCB(s);
+				applySYNoptions(s, &h->options);
+				s->tx.window = h->window; // The window in a SYN is never scaled
+				s->tx.rawseq = h->iss + 1; // Our TX zero point is right past the phantom byte of our SYN
+				s->rx.rawseq = h->irs + 1; // And theirs right past the phantom byte of their SYN
+				s->state = SYN_RECEIVED;
+				s->accepted = 0; // No one has called accept and received this stream yet
+				s->inUse = 1;
+				releaseHalfOpen(h);
+				TCPprocessor(s, ip, tcp); // Finishes the handshake, and takes in any data this segment carries
+				return;
+			}
+		}
+		puts("No free stream"); // Keep the entry, our SYN-ACK resend or their next segment will try again
+	}
+	else if(tcp->flags & ACK)
+		TCPreset(ip, tcp); // An unacceptable ACK in SYN_RECEIVED gets a RST, the half-open entry stays (RFC 793)
+}
+
+// Our side of the connection is done. The stream goes back to the pool right away, and only what is needed
+// to answer late segments waits out TIME_WAIT in the timeWait table.
+static void enterTimeWait(struct Stream *const s) {
+	s->state = TIME_WAIT; // So rcvNext() counts their FIN
+	if(s->ackNow || s->ackPending)
+		sendTCPpacket(s, s->tx.next, rcvNext(s), ACK, NULL, 0, 0, NULL); // The stream is gone by the time ACKs are flushed
+	const uint32_t now = now_ms();
+	struct TimeWait *t = &timeWait[0];
+	for(uint8_t i = 0; i < MAX_TIME_WAIT; i++) {
+		if(!timeWaitActive(&timeWait[i], now)) {
+			t = &timeWait[i];
+			break;
+		}
+		if((int32_t)(timeWait[i].expires - t->expires) < 0)
+			t = &timeWait[i]; // If all are in use, the one closest to expiring makes way
+	}
+	t->remoteIP = s->remoteIP;
+	t->remotePort = s->remotePort;
+	t->localPort = s->localPort;
+	t->sndNext = s->tx.next + s->tx.rawseq;
+	t->rcvNext = rcvNext(s) + s->rx.rawseq;
+	t->expires = now + TIME_WAIT_SECONDS * 1000UL;
+	t->tsRecent = s->tcb.tsRecent;
+	t->timestamps = s->timestamps;
+	t->inUse = 1;
+	releaseStream(s);
+}
+
+static uint8_t timeWaitActive(const struct TimeWait *const t, const uint32_t now) {
+	return t->inUse && (int32_t)(t->expires - now) > 0; // Entries expire lazily, when they are looked at
+}
+
+// Handles a segment for a connection in TIME_WAIT. Returns 1 if it was one, 0 if there is no such connection.
+uint8_t TCPtimeWait(const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp) {
+	const uint32_t now = now_ms();
+	for(uint8_t i = 0; i < MAX_TIME_WAIT; i++) {
+		struct TimeWait *const t = &timeWait[i];
+		if(timeWaitActive(t, now) && t->localPort == tcp->destPort && t->remotePort == tcp->srcPort
+			&& memcmp(&t->remoteIP, &ip->srcIP, sizeof(struct IPv4)) == 0) {
+			if(tcp->flags & RST)
+				return 1; // RFC 1337, ignore it so TIME_WAIT can't be cut short
+			if((tcp->flags & SYN) && !(tcp->flags & ACK) && (int32_t)(tcp->seq - t->rcvNext) > 0) {
+				t->inUse = 0; // RFC 1122 4.2.2.13, a new connection with higher sequence numbers may reuse this one
+				return 0;
+			}
+			if(tcp->flags & FIN) // Our ACK of their FIN was lost, restart the wait
+				t->expires = now + TIME_WAIT_SECONDS * 1000UL;
+			else if(tcp->seq == t->rcvNext && !(tcp->flags & SYN) && ip->length - ip->iht * 4 - tcp->offset * 4 == 0)
+				return 1; // An acceptable segment with nothing in it, like a stray ACK, is dropped silently (RFC 793)
+			uint8_t options[TCP_TS_OPTION];
+			sendTCPsegment(&t->remoteIP, t->localPort, t->remotePort, t->sndNext, t->rcvNext, ACK, 0,
+						   options, t->timestamps ? buildTSoption(options, t->tsRecent) : 0, 0, NULL);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Returns 1 if a connection between these ports and address is still in TIME_WAIT, so connect() won't reuse it
+uint8_t TCPinTimeWait(const uint16_t localPort, const struct IPv4 *const remoteIP, const uint16_t remotePort) {
+	const uint32_t now = now_ms();
+	for(uint8_t i = 0; i < MAX_TIME_WAIT; i++) {
+		const struct TimeWait *const t = &timeWait[i];
+		if(timeWaitActive(t, now) && t->localPort == localPort && t->remotePort == remotePort
+			&& memcmp(&t->remoteIP, remoteIP, sizeof(struct IPv4)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// Answers a segment that has no connection with a RST, as in the CLOSED state of RFC 793.
+// Nothing is sent in reply to a RST, or for segments that weren't sent to our own address.
+void TCPreset(const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp) {
+	if((tcp->flags & RST) || memcmp(&ip->destIP, &localIP, sizeof(struct IPv4)) != 0)
+		return;
+	if(tcp->flags & ACK) // Make the RST look like it comes right where they think we are
+		sendTCPsegment(&ip->srcIP, tcp->destPort, tcp->srcPort, tcp->ack, 0, RST, 0, NULL, 0, 0, NULL);
+	else { // Otherwise ACK everything in their segment, so they accept the RST
+		const uint32_t len = ip->length - ip->iht * 4 - tcp->offset * 4 + ((tcp->flags & SYN) ? 1 : 0) + ((tcp->flags & FIN) ? 1 : 0);
+		sendTCPsegment(&ip->srcIP, tcp->destPort, tcp->srcPort, 0, tcp->seq + len, RST | ACK, 0, NULL, 0, 0, NULL);
+	}
+}
+
+// Resets the state of a stream's connection before the handshake
+static void initTCB(struct Stream *const s) {
+	s->tx.next = 0; // This is not initialized by TCPlisten() or connect()
+	s->finPending = 0;
+	timerSetup(&s->timer, TCPtimerExpired, s);
+	timerSetup(&s->ackTimer, TCPdelayedACK, s);
+	s->ackPending = 0;
+	s->ackNow = 0;
+	s->tcb.oooCount = 0;
+	s->tcb.sackedCount = 0;
+	s->tcb.segCount = 0;
+	s->tcb.srtt = 0; // No RTT samples yet
+	s->tcb.rttvar = 0;
+	s->tcb.rto = TCP_RTO_INITIAL;
+	s->tcb.dupACKs = 0;
+	s->inRecovery = 0;
+	s->retries = 0;
+	s->tcb.windowEnd = 0; // So the first segment offers the whole buffer
+	s->tcb.lastACK = 0; // What the ACK of their SYN is, relative to rawseq
+	s->tcb.progmemLen = 0;
+	s->timestamps = 0;
+}
+
+// Takes the MSS, window scale and SACK-permitted options from a SYN or SYN-ACK
+static void parseSYNoptions(const struct TCPheader *const restrict tcp, struct SYNoptions *const restrict options) {
+	const uint8_t *const scale = getTCPoption(tcp, 3); // Process window scaling option
+	// Scaling is only on if both ends send the option, and then it applies in both directions
+	options->windowScaling = scale != NULL && scale[0] == 3;
+	if(!options->windowScaling)
+		options->scale = 0;
+	else
+		options->scale = scale[1] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : scale[1];
+	options->sackPermitted = getTCPoption(tcp, 4) != NULL; // Only use SACK if they offered it
+	const uint8_t *const ts = getTCPoption(tcp, 8);
+	options->timestamps = ts != NULL && ts[0] == 10; // Like the others, only on if both ends send it
+	options->tsVal = options->timestamps ? ((const struct Timestamps *)&ts[1])->val : 0;
+	const uint8_t *const mss = getTCPoption(tcp, 2);
+	if(mss == NULL || mss[0] != 4)
+		options->mss = TCP_DEFAULT_MSS; // RFC 1122 4.2.2.6
+	else {
+		const uint16_t theirs = (mss[1] << 8) | mss[2];
+		options->mss = theirs > TCP_MAX_MSS ? TCP_MAX_MSS : theirs < TCP_MIN_MSS ? TCP_MIN_MSS : theirs;
+	}
+}
+
+// Sets up a stream with the options negotiated in the handshake
+static void applySYNoptions(struct Stream *const restrict s, const struct SYNoptions *const restrict options) {
+	s->windowScaling = options->windowScaling;
+	s->tcb.scale = options->scale;
+	s->sackPermitted = options->sackPermitted;
+	s->timestamps = options->timestamps;
+	s->tcb.tsRecent = options->tsVal;
+	s->tcb.mss = options->mss;
+	// RFC 5681 3.1, initial window of 2 to 4 segments depending on the MSS
+	s->tcb.cwnd = s->tcb.mss > 2190 ? 2 * s->tcb.mss : s->tcb.mss > 1095 ? 3 * s->tcb.mss : 4 * s->tcb.mss;
+	s->tcb.ssthresh = UINT32_MAX; // Slow start until the first loss
+}
+
+// Writes the options of our SYN or SYN-ACK and returns their length.
+// The SACK-permitted, window scale and timestamps options may only be in a SYN-ACK if they were in the SYN.
+// tsEcr is their timestamp we echo, or 0 in a SYN.
+static uint8_t buildSYNoptions(uint8_t options[TCP_SYN_OPTIONS], const uint8_t sackPermitted, const uint8_t windowScaling,
+	const uint8_t timestamps, const uint32_t tsEcr) {
+	memcpy(options, (uint8_t [4]){2, 4, TCP_DEFAULT_MSS >> 8, TCP_DEFAULT_MSS & 0xFF}, 4); // MSS option
+	uint8_t optionsLen = 4;
+	if(timestamps) {
+		optionsLen += buildTSoption(&options[optionsLen], tsEcr);
+		if(sackPermitted) { // SACK permitted takes the place of the two NOPs, like Linux does
+			options[4] = 4;
+			options[5] = 2;
+		}
+	}
+	else if(sackPermitted) { // SACK permitted, NOPs make size a multiple of 4
+		memcpy(&options[optionsLen], (uint8_t [4]){1, 1, 4, 2}, 4);
+		optionsLen += 4;
+	}
+	if(windowScaling) { // Window scale
+		memcpy(&options[optionsLen], (uint8_t [4]){1, 3, 3, TCP_RX_WSCALE}, 4);
+		optionsLen += 4;
+	}
+	return optionsLen;
+}
+
+// Writes a timestamps option carrying our clock and returns its length
+static uint8_t buildTSoption(uint8_t option[TCP_TS_OPTION], const uint32_t tsEcr) {
+	option[0] = 1;
+	option[1] = 1; // Two NOPs to keep the values 4-byte aligned
+	option[2] = 8;
+	option[3] = 10;
+	struct Timestamps *const ts = (struct Timestamps *)&option[4];
+	ts->val = now_ms(); // RFC 7323 5.4, a millisecond clock ticks well within the allowed range
+	ts->ecr = tsEcr;
+	return TCP_TS_OPTION;
+}
+
+// RFC 7323 5.3, on a connection using timestamps, a segment older than the last one we took a timestamp from
+// is an old duplicate (PAWS). It is dropped, and our ACK tells them where we are. Returns 0 if it was dropped.
+// Otherwise this remembers their timestamp to echo, if the segment is in order.
+static uint8_t checkTimestamp(struct Stream *const restrict s, const struct TCPheader *const restrict tcp) {
+	const uint8_t *const option = getTCPoption(tcp, 8);
+	if(option == NULL || option[0] != 10)
+		return 1; // The RFC allows dropping segments without one, but nothing depends on it here
+	const struct Timestamps *const ts = (const struct Timestamps *)&option[1];
+	if((int32_t)(ts->val - s->tcb.tsRecent) < 0) {
+		if(!(tcp->flags & RST))
+			s->ackNow = 1;
+		return tcp->flags & RST; // PAWS doesn't apply to RSTs
+	}
+	// Only from a segment that covers the last ACK we sent, so delayed ACKs echo the time of the earliest segment
+	if((int32_t)(tcp->seq - s->rx.rawseq - s->tcb.lastACK) <= 0)
+		s->tcb.tsRecent = ts->val;
+	return 1;
+}
+
+// Sends (or resends) the SYN-ACK of a half-open connection and waits for the ACK of it
+static void sendSYNACK(struct HalfOpen *const h) {
+	uint8_t options[TCP_SYN_OPTIONS];
+	sendTCPsegment(&h->remoteIP, sockets[h->parent].port, h->remotePort, h->iss, h->irs + 1, SYN | ACK,
+				   STREAM_RX_SIZE > 0xFFFF ? 0xFFFF : STREAM_RX_SIZE, // The window in a SYN is never scaled
+				   options, buildSYNoptions(options, h->options.sackPermitted, h->options.windowScaling,
+											h->options.timestamps, h->options.tsVal), 0, NULL);
+	timerArm(&h->timer, h->rto);
+}
+
+// Called from handleTimers() when the ACK of a SYN-ACK didn't come in time
+static void halfOpenExpired(void *const arg) {
+	struct HalfOpen *const h = arg;
+	if(h->retries >= TCP_MAX_SYNACK_RETRIES || !sockets[h->parent].inUse || !sockets[h->parent].listening)
+		releaseHalfOpen(h); // Give up, the entry can take another SYN
+	else {
+		h->retries++;
+		h->rto = h->rto > TCP_RTO_MAX / 2 ? TCP_RTO_MAX : h->rto * 2; // RFC 6298 5.5, back off the timer
+		sendSYNACK(h);
+	}
+}
+
+static void releaseHalfOpen(struct HalfOpen *const h) {
+	timerCancel(&h->timer);
+	h->inUse = 0;
+}
+
+// Writes a received TCP payload into the RX buffer at its place in the sequence space. In-order data moves head,
+// and anything past a hole is remembered as an out-of-order block so it can be SACKed and later pulled in.
+static void receivePayload(struct Stream *const restrict s, const struct TCPheader *const restrict tcp, const uint16_t payloadLen) {
+	const uint32_t seq = tcp->seq - s->rx.rawseq; // Relative sequence number of the first payload byte
+	uint32_t start = seq;
+	uint32_t end = seq + payloadLen;
+	if((int32_t)(start - s->rx.head) < 0) // Part of this segment was already received, skip over it
+		start = s->rx.head;
+	if((int32_t)(end - (s->rx.tail + STREAM_RX_SIZE)) > 0) // Drop whatever doesn't fit in our buffer
+		end = s->rx.tail + STREAM_RX_SIZE;
+	if((int32_t)(end - start) <= 0)
+		return; // Nothing new in this segment, or it is entirely outside our window
+	const uint32_t wanted = end;
+	end = ringReserve(s->rx.chunks, STREAM_RX_SIZE, start, end, 0); // Or in the chunk pool, they will resend the rest
+	if(end != wanted && start == s->rx.head && s->tcb.oooCount > 0) {
+		// The pool ran out, and out-of-order data holding chunks can't be read until this hole is filled.
+		// Give those back and forget the blocks (reneging, RFC 2018 8), or the hole could never be filled.
+		s->tcb.oooCount = 0;
+		s->tcb.oooRecent = SACK_BLOCKS;
+		ringTrim(s->rx.chunks, STREAM_RX_SIZE, s->rx.tail, s->rx.head);
+		end = ringReserve(s->rx.chunks, STREAM_RX_SIZE, start, wanted, 0);
+	}
+	if(end == start)
+		return;
+	ringWrite(s->rx.chunks, STREAM_RX_SIZE, start, (uint8_t *)tcp + tcp->offset * 4 + (start - seq), end - start); // Write in this data
+	if(start == s->rx.head) { // Is this payload contiguous with any previous payloads?
+		s->rx.head = end;
+		// This may have filled the hole in front of out-of-order blocks we already have
+		while(s->tcb.oooCount > 0 && s->tcb.ooo[0].start <= s->rx.head) {
+			if(s->tcb.ooo[0].end > s->rx.head)
+				s->rx.head = s->tcb.ooo[0].end;
+			removeSACKblock(s->tcb.ooo, &s->tcb.oooCount, 0);
+		}
+		s->tcb.oooRecent = SACK_BLOCKS; // The most recent segment is no longer out of order
+	}
+	else {
+		puts("Not contiguous");
+		s->tcb.oooRecent = addSACKblock(s->tcb.ooo, &s->tcb.oooCount, start, end);
+	}
+}
+
+// Processes the acknowledgement fields of an incoming segment: send window, tail, congestion window and the SACK scoreboard
+static void processACK(struct Stream *const restrict s, const struct TCPheader *const restrict tcp, const uint16_t payloadLen) {
+	if(!(tcp->flags & ACK))
+		return;
+	const uint32_t window = (uint32_t)tcp->window << s->tcb.scale;
+	const uint8_t windowUpdate = window != s->tx.window;
+	if(s->tx.window == 0 && window > 0 && s->tcb.segCount == 0 && s->tx.next < s->tx.head) { // Their window reopened
+		timerCancel(&s->timer); // Stop the persist timer, sendWhatWeCan() arms the retransmit timer instead
+		s->retries = 0;
+	}
+	s->tx.window = window; // Update our send window
+	const uint32_t ack = tcp->ack - s->tx.rawseq;
+	const uint32_t flight = s->tx.next - s->tx.tail;
+	// Ignore old ACKs, and ACKs for data we never sent. Once our FIN is sent, next includes its phantom byte.
+	if(ack > s->tx.tail && ack <= s->tx.next) {
+		const uint32_t acked = ack - s->tx.tail;
+		s->tx.tail = ack; // Move tail to after last ACKed byte
+		if(s->tcb.progmemLen > 0 && s->tx.tail >= s->tcb.progmemStart + s->tcb.progmemLen)
+			s->tcb.progmemLen = 0; // All the flash data is ACKed, the TX buffer can take data again
+		int32_t rtt = -1;
+		const uint8_t *const ts = s->timestamps ? getTCPoption(tcp, 8) : NULL;
+		if(ts != NULL && ts[0] == 10) { // RFC 7323 4.1, the time we echoed back gives an RTT sample, even for resent segments
+			const uint32_t echoed = now_ms() - ((const struct Timestamps *)&ts[1])->ecr;
+			if(echoed <= TCP_RTO_MAX) // Anything longer is not one of our timestamps
+				rtt = echoed > TCP_RTT_MAX ? TCP_RTT_MAX : echoed;
+		}
+		ackSegments(s, rtt);
+		// We won't need to resend ACKed data. A segment that is only partly ACKed is still resent whole, so keep all of it.
+		ringTrim(s->tx.chunks, STREAM_TX_SIZE, s->tcb.segCount > 0 ? SEGMENT(s, 0)->start : s->tx.tail, txRingEnd(s));
+		congestionACK(s, acked, flight);
+		if(s->tcb.segCount > 0) { // RFC 6298 5.3, restart the timer for what is still outstanding
+			timerArm(&s->timer, s->tcb.rto);
+			retransmitLost(s); // If a timeout left more segments to resend, each ACK lets one more out
+		}
+		else
+			timerCancel(&s->timer); // Everything is ACKed, so turn off the retransmission timer
+	}
+	// RFC 5681 2, an ACK that doesn't move tail while data is outstanding means a segment after a hole reached
+	// the peer. Only if it is nothing else: no data, no SYN or FIN, and no window update.
+	else if(ack == s->tx.tail && s->tcb.segCount > 0 && payloadLen == 0 && !(tcp->flags & (SYN | FIN)) && !windowUpdate) {
+		if(s->inRecovery)
+			s->tcb.cwnd += s->tcb.mss; // Each duplicate ACK means a segment left the network, RFC 6582 3.2 step 3
+		else if(++s->tcb.dupACKs == TCP_DUPACK_THRESHOLD) { // Fast retransmit, RFC 6582 3.2 step 2
+			congestionLoss(s, flight);
+			s->tcb.cwnd = s->tcb.ssthresh + TCP_DUPACK_THRESHOLD * s->tcb.mss; // The three segments that left the network
+			s->tcb.recover = s->tx.next; // Recovery is over once everything sent so far is ACKed
+			s->inRecovery = 1;
+			SEGMENT(s, 0)->lost = 1;
+			retransmitLost(s);
+			timerArm(&s->timer, s->tcb.rto);
+		}
+	}
+	while(s->tcb.sackedCount > 0 && s->tcb.sacked[0].end <= s->tx.tail) // Forget SACKed ranges that are now cumulatively ACKed
+		removeSACKblock(s->tcb.sacked, &s->tcb.sackedCount, 0);
+	if(s->tcb.sackedCount > 0 && s->tcb.sacked[0].start < s->tx.tail)
+		s->tcb.sacked[0].start = s->tx.tail;
+
+	const uint8_t *const sack = s->sackPermitted ? getTCPoption(tcp, 5) : NULL;
+	if(sack != NULL) {
+		const struct SACKedge *const edges = (struct SACKedge *)&sack[1];
+		for(uint8_t i = 0; i < (sack[0] - 2) / sizeof(struct SACKedge); i++) {
+			const uint32_t start = edges[i].left - s->tx.rawseq;
+			const uint32_t end = edges[i].right - s->tx.rawseq;
+			if(start >= s->tx.tail && start < end && end <= s->tx.next) // Only keep ranges that are really in flight
+				addSACKblock(s->tcb.sacked, &s->tcb.sackedCount, start, end);
+		}
+	}
+	rebaseTX(s);
+}
+
+// Grows the congestion window when new data is ACKed, or handles a partial or full ACK during fast recovery
+static void congestionACK(struct Stream *const s, const uint32_t acked, const uint32_t flight) {
+	s->tcb.dupACKs = 0;
+	if(s->inRecovery) {
+		if(s->tx.tail >= s->tcb.recover) { // Full ACK, RFC 6582 3.2 step 3 option 1
+			const uint32_t left = flight - acked; // What is still in flight
+			s->tcb.cwnd = left + s->tcb.mss < s->tcb.ssthresh ? left + s->tcb.mss : s->tcb.ssthresh;
+			s->inRecovery = 0;
+		}
+		else { // Partial ACK, the next hole was lost too. Resend it and deflate the window by what was ACKed.
+			if(s->tcb.segCount > 0)
+				SEGMENT(s, 0)->lost = 1; // processACK() resends it
+			s->tcb.cwnd = (s->tcb.cwnd > acked ? s->tcb.cwnd - acked : 0) + s->tcb.mss;
+		}
+	}
+	else if(s->tcb.cwnd < s->tcb.ssthresh) // Slow start, RFC 5681 3.1
+		s->tcb.cwnd += acked < s->tcb.mss ? acked : s->tcb.mss;
+	else { // Congestion avoidance, about one MSS per round trip
+		const uint32_t increase = (uint32_t)s->tcb.mss * s->tcb.mss / s->tcb.cwnd;
+		s->tcb.cwnd += increase > 0 ? increase : 1;
+	}
+}
+
+// RFC 5681 equation 4, halve what we allow in flight after a loss
+static void congestionLoss(struct Stream *const s, const uint32_t flight) {
+	s->tcb.ssthresh = flight / 2 > 2UL * s->tcb.mss ? flight / 2 : 2UL * s->tcb.mss;
+}
+
+// Adds a range to a sorted list of SACK blocks, merging it with any blocks it overlaps or touches.
+// If the list is full, the block furthest along in the sequence space is forgotten.
+// Returns the index the range ended up at, or SACK_BLOCKS if it was the one forgotten.
+static uint8_t addSACKblock(struct SACKblock blocks[], uint8_t *const count, uint32_t start, uint32_t end) {
+	for(uint8_t i = 0; i < *count;) {
+		if(blocks[i].start <= end && blocks[i].end >= start) { // Overlapping or adjacent
+			if(blocks[i].start < start)
+				start = blocks[i].start;
+			if(blocks[i].end > end)
+				end = blocks[i].end;
+			removeSACKblock(blocks, count, i);
+		}
+		else
+			i++;
+	}
+	if(*count == SACK_BLOCKS) {
+		if(start > blocks[SACK_BLOCKS - 1].start)
+			return SACK_BLOCKS; // The new range is the furthest along, so drop it
+		*count -= 1; // Otherwise drop the last block to make room
+	}
+	uint8_t i = *count;
+	for(; i > 0 && blocks[i - 1].start > start; i--)
+		blocks[i] = blocks[i - 1]; // Shift later blocks up to keep the list sorted
+	blocks[i].start = start;
+	blocks[i].end = end;
+	*count += 1;
+	return i;
+}
+
+static void removeSACKblock(struct SACKblock blocks[], uint8_t *const count, const uint8_t index) {
+	*count -= 1;
+	for(uint8_t i = index; i < *count; i++)
+		blocks[i] = blocks[i + 1];
+}
+
+// Writes a SACK option describing our out-of-order data into option, returns its length (a multiple of 4)
+// Only as many blocks as fit in room bytes are written, the most recent one is always first
+static uint8_t buildSACKoption(const struct Stream *const s, uint8_t option[], const uint8_t room) {
+	if(!s->sackPermitted || s->tcb.oooCount == 0 || room < 4 + sizeof(struct SACKedge))
+		return 0;
+	const uint8_t fit = (room - 4) / sizeof(struct SACKedge);
+	const uint8_t blocks = s->tcb.oooCount < fit ? s->tcb.oooCount : fit;
+	option[0] = 1;
+	option[1] = 1; // Two NOPs to keep the blocks 4-byte aligned
+	option[2] = 5;
+	option[3] = 2 + blocks * sizeof(struct SACKedge);
+	struct SACKedge *edges = (struct SACKedge *)&option[4];
+	uint8_t written = 0;
+	if(s->tcb.oooRecent < s->tcb.oooCount) { // RFC 2018 wants the block with the most recent segment first
+		edges->left = s->tcb.ooo[s->tcb.oooRecent].start + s->rx.rawseq;
+		edges->right = s->tcb.ooo[s->tcb.oooRecent].end + s->rx.rawseq;
+		edges++;
+		written++;
+	}
+	for(uint8_t i = 0; i < s->tcb.oooCount && written < blocks; i++) {
+		if(i != s->tcb.oooRecent) {
+			edges->left = s->tcb.ooo[i].start + s->rx.rawseq;
+			edges->right = s->tcb.ooo[i].end + s->rx.rawseq;
+			edges++;
+			written++;
+		}
+	}
+	return 4 + blocks * sizeof(struct SACKedge);
+}
+
+// How much data fits in one segment, leaving room for the timestamps and SACK blocks the segment would carry right now
+static uint16_t segmentSize(const struct Stream *const s) {
+	const uint16_t mss = s->timestamps ? s->tcb.mss - TCP_TS_OPTION : s->tcb.mss;
+	if(s->sackPermitted && s->tcb.oooCount > 0)
+		return mss - (4 + s->tcb.oooCount * sizeof(struct SACKedge));
+	return mss;
+}
+
+// Sends (or resends) a segment from the retransmit queue straight out of the TX buffer, one piece per chunk it is in.
+// Pieces in the ENC28J60's memory are copied into the frame there, and never cross the SPI bus again.
+static void sendSegment(struct Stream *const s, const struct TXsegment *const seg) {
+	struct Layer spans[TX_SEGMENT_SPANS + 1]; // The chunks it is in, and then some flash data
+	const RING_INDEX ringEnd = txRingEnd(s);
+	const uint16_t inRing = seg->start >= ringEnd ? 0 : seg->start + seg->len > ringEnd ? ringEnd - seg->start : seg->len;
+	uint8_t count = ringSpans(s->tx.chunks, STREAM_TX_SIZE, seg->start, inRing, spans, TX_SEGMENT_SPANS);
+	if(inRing < seg->len) // The rest is from TCPsendProgmem(), read straight from flash every time it is sent
+		spans[count++] = (struct Layer){(const uint8_t *)s->tcb.progmem + (seg->start + inRing - s->tcb.progmemStart),
+										seg->len - inRing, LAYER_FLASH};
+	sendTCPpacket(s, seg->start, rcvNext(s), seg->fin ? FIN | ACK : ACK, NULL, 0, count, spans);
+}
+
+// Removes the segments that are now entirely ACKed from the retransmit queue, and updates the RTO with rtt.
+// Without a timestamp sample (rtt < 0) it is taken from the ACKed segments instead.
+static void ackSegments(struct Stream *const s, int32_t rtt) {
+	while(s->tcb.segCount > 0) {
+		const struct TXsegment *const seg = SEGMENT(s, 0);
+		if(seg->start + seg->len + seg->fin > s->tx.tail)
+			break; // Not entirely ACKed yet
+		if(rtt < 0 && seg->retransmits == 0) // Karn's rule, we can't tell which transmission a resent segment's ACK is for
+			rtt = (uint16_t)((uint16_t)now_ms() - seg->sent);
+		s->tcb.segFirst = (s->tcb.segFirst + 1) & (TX_SEGMENTS - 1);
+		s->tcb.segCount--;
+	}
+	if(rtt >= 0)
+		updateRTO(&s->tcb, rtt);
+}
+
+// RFC 6298 section 2. srtt is kept times 8 and rttvar times 4 so the gains are shifts, as in BSD
+static void updateRTO(struct TCB *const tcb, uint16_t rtt) {
+	if(rtt == 0)
+		rtt = 1; // Our clock granularity, this also keeps srtt nonzero once we have a sample
+	else if(rtt > TCP_RTT_MAX)
+		rtt = TCP_RTT_MAX;
+	if(tcb->srtt == 0) { // First measurement
+		tcb->srtt = rtt << 3; // SRTT = R
+		tcb->rttvar = rtt << 1; // RTTVAR = R/2
+	}
+	else {
+		int16_t delta = rtt - (tcb->srtt >> 3);
+		tcb->srtt += delta; // SRTT = 7/8 SRTT + 1/8 R
+		if(delta < 0)
+			delta = -delta;
+		tcb->rttvar += delta - (tcb->rttvar >> 2); // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+	}
+	const uint32_t rto = (tcb->srtt >> 3) + (tcb->rttvar > 1 ? tcb->rttvar : 1); // RTO = SRTT + max(G, 4 * RTTVAR)
+	tcb->rto = rto < TCP_RTO_MIN ? TCP_RTO_MIN : rto > TCP_RTO_MAX ? TCP_RTO_MAX : rto; // This also drops any backoff
+}
+
+static uint8_t segmentSACKed(const struct Stream *const s, const struct TXsegment *const seg) {
+	for(uint8_t i = 0; i < s->tcb.sackedCount; i++)
+		if(!seg->fin && s->tcb.sacked[i].start <= seg->start && s->tcb.sacked[i].end >= seg->start + seg->len)
+			return 1; // A FIN can't be SACKed
+	return 0;
+}
+
+// Resends the oldest segment marked lost that the peer hasn't SACKed
+static void retransmitLost(struct Stream *const s) {
+	for(uint8_t i = 0; i < s->tcb.segCount; i++) {
+		struct TXsegment *const seg = SEGMENT(s, i);
+		if(seg->lost) {
+			seg->lost = 0;
+			if(!segmentSACKed(s, seg)) {
+				sendSegment(s, seg);
+				seg->sent = now_ms();
+				seg->retransmits++;
+				return;
+			}
+		}
+	}
+}
+
+// Sends the data written by the user that fits in the send window, in segments no larger than the peer's MSS.
+// Unless flush is set or the socket has TCP_NODELAY, a final small segment is held back by Nagle's algorithm
+// while earlier data is still unACKed.
+// Once the user has closed the stream, our FIN is sent on the segment that carries the last of the data.
+static void sendWhatWeCan(const int8_t stream, const uint8_t flush) {
+	struct Stream *const s = &streams[stream];
+	const uint16_t maxLen = segmentSize(s);
+	// RFC 3042 limited transmit, the first two duplicate ACKs each let one more new segment out, since they
+	// mean segments left the network. That gives the peer enough to send the third duplicate ACK.
+	const uint32_t cwnd = s->tcb.cwnd + (s->inRecovery ? 0 : s->tcb.dupACKs * s->tcb.mss);
+	const uint32_t windowEnd = s->tx.tail + (s->tx.window < cwnd ? s->tx.window : cwnd); // Peer's and network's limit
+	const uint32_t ableEnd = windowEnd < s->tx.head ? windowEnd : s->tx.head; // Calculate how much we can send based on send window
+	// Each segment also needs room in the queue, to be remembered until it is ACKed
+	while(s->tx.next <= s->tx.head && s->tcb.segCount < TX_SEGMENTS) { // Once our FIN is out, nothing can come after it
+		const uint32_t sendEnd = ableEnd <= s->tx.next ? s->tx.next : ableEnd - s->tx.next > maxLen ? s->tx.next + maxLen : ableEnd;
+		const uint8_t fin = s->finPending && sendEnd == s->tx.head; // Nothing more will be written, so FIN can ride on this segment
+		if(sendEnd <= s->tx.next && !fin)
+			break; // Nothing to send
+		if(!flush && !s->finPending && !sockets[s->parent].noDelay && s->tx.next != s->tx.tail && sendEnd - s->tx.next < NAGLE_FULL_SIZE(maxLen))
+			break; // Wait for the ACK of what is in flight, more writes can be coalesced into this segment meanwhile
+		struct TXsegment *const seg = SEGMENT(s, s->tcb.segCount);
+		seg->start = s->tx.next;
+		seg->len = sendEnd - s->tx.next;
+		seg->sent = now_ms();
+		seg->retransmits = 0;
+		seg->lost = 0;
+		seg->fin = fin;
+		s->tcb.segCount++;
+		sendSegment(s, seg);
+		s->tx.next = sendEnd + fin; // The FIN takes up one sequence number after the data
+		if(fin)
+			s->finPending = 0;
+		if(!timerArmed(&s->timer)) // RFC 6298 5.1, don't push back a timer already running for older data
+			timerArm(&s->timer, s->tcb.rto);
+	}
+	// RFC 1122 4.2.2.17, with their window closed and nothing in flight, no ACK would ever tell us it reopened.
+	// The timer then runs as the persist timer and probes the window.
+	if(s->tcb.segCount == 0 && s->tx.window == 0 && s->tx.next < s->tx.head && !timerArmed(&s->timer))
+		timerArm(&s->timer, s->tcb.rto);
+}
+
+// The window to put on a segment with these flags, in the units of its window field.
+// To avoid silly window syndrome, a reader draining the RX buffer a few bytes at a time doesn't move the right edge
+// until it can move by TCP_RX_SWS_STEP, otherwise the peer would fill each tiny opening with a tiny segment.
+static uint16_t advertisedWindow(struct Stream *const s, const uint16_t flags) {
+	const uint8_t shift = (s->windowScaling && !(flags & SYN)) ? TCP_RX_WSCALE : 0; // SYNs are never scaled
+	uint32_t end = s->rx.tail + STREAM_RX_SIZE; // Right edge if we offered all the free space
+	const uint32_t room = ringRoom(s->rx.chunks, STREAM_RX_SIZE, s->rx.head);
+	if(room < end - s->rx.head)
+		end = s->rx.head + room; // Or what the chunk pool has left
+	uint8_t roundUp = 0;
+	if((int32_t)(end - s->tcb.windowEnd) < TCP_RX_SWS_STEP && (int32_t)(s->tcb.windowEnd - s->rx.head) >= 0) {
+		end = s->tcb.windowEnd; // Keep the edge where it was, it must never move back, even if the chunk pool shrank
+		roundUp = 1; // And don't let the scaling round it back either
+	}
+	uint32_t window = (end - s->rx.head + (roundUp ? (1UL << shift) - 1 : 0)) >> shift;
+	if(window > 0xFFFF)
+		window = 0xFFFF;
+	s->tcb.windowEnd = s->rx.head + (window << shift);
+	return window;
+}
+
+// data is a list of dataNum pieces that are sent back to back as the payload, so it can come straight from a ring buffer
+static void sendTCPpacket(struct Stream *const restrict stream, const uint32_t seq, const uint32_t ack, 
+	const uint16_t flags, const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]) {
+	uint16_t dataLen = 0;
+	for(uint8_t i = 0; i < dataNum; i++)
+		dataLen += data[i].len;
+	uint8_t allOptions[optionsLen + TCP_TS_OPTION + 4 + SACK_BLOCKS * sizeof(struct SACKedge)];
+	if(optionsLen > 0)
+		memcpy(allOptions, options, optionsLen);
+	// RFC 7323 3.2, once negotiated every segment but a RST carries timestamps. SYNs bring their own.
+	const uint8_t tsLen = stream->timestamps && !(flags & (SYN | RST)) ? buildTSoption(&allOptions[optionsLen], stream->tcb.tsRecent) : 0;
+	// SACK blocks must not push a data segment past the peer's MSS (RFC 6691) or the header past its size limit
+	uint8_t room = TCP_MAX_OPTIONS - optionsLen - tsLen;
+	if(dataLen > 0 && stream->tcb.mss - dataLen - tsLen < room)
+		room = stream->tcb.mss > dataLen + tsLen ? stream->tcb.mss - dataLen - tsLen : 0;
+	const uint8_t allOptionsLen = optionsLen + tsLen + ((flags & ACK) ? buildSACKoption(stream, &allOptions[optionsLen + tsLen], room) : 0);
+	if(flags & ACK) { // Every segment carries our latest ACK, so there is no longer one pending
+		stream->tcb.lastACK = ack;
+		stream->ackPending = 0;
+		stream->ackNow = 0;
+		timerCancel(&stream->ackTimer);
+	}
+	sendTCPsegment(&stream->remoteIP, stream->localPort, stream->remotePort, seq + stream->tx.rawseq, ack + stream->rx.rawseq,
+				   flags, advertisedWindow(stream, flags), allOptions, allOptionsLen, dataNum, data);
+}
+
+// Builds and sends one TCP segment. The sequence numbers here are raw, this doesn't need a stream.
+static void sendTCPsegment(const struct IPv4 *const restrict dest, const uint16_t srcPort, const uint16_t destPort,
+	const uint32_t seq, const uint32_t ack, const uint16_t flags, const uint16_t window,
+	const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]) {
+	uint16_t dataLen = 0;
+	for(uint8_t i = 0; i < dataNum; i++)
+		dataLen += data[i].len;
+	struct TCPheader pkt = {.srcPort = srcPort, 
+							.destPort = destPort,
+							.seq = seq, .ack = ack,  
 							.offset = (sizeof(struct TCPheader) + optionsLen) / 4, 
 							.zero = 0, .flags = flags, 
-							.window = STREAM_RX_SIZE - (stream->rx.head - stream->rx.tail),
+							.window = window,
 							.checksum = 0, .urgent = 0};
-	pkt.checksum = TCPchecksum(&stream->remoteIP, &pkt, options, optionsLen, data, dataLen);
-	sendIPv4packet(&stream->remoteIP, &localIP, PROTO_TCP, sizeof(pkt) + optionsLen + dataLen, 3, 
-						LAYERS({&pkt, sizeof(pkt)},
-							   {options, optionsLen},
-							   {data, dataLen}));
-}
-
-void handleTCPtimers(void) {
-	// This function handles timer-dependent TCP operations
-	for(uint16_t i = 0; i < MAX_STREAMS; i++) {
-		if(streams[i].inUse && streams[i].state != UDP_MODE) {
-			if(streams[i].state == TIME_WAIT && RTCtimerDone(streams[i].timer)) { // If TIME_WAIT timer finished
-				streams[i].state = CLOSED;
-				streams[i].inUse = 0;
+	pkt.checksum = TCPchecksum(dest, &pkt, options, optionsLen, dataNum, data);
+	struct Layer layers[2 + dataNum];
+	layers[0] = (struct Layer){&pkt, sizeof(pkt), LAYER_RAM};
+	layers[1] = (struct Layer){options, optionsLen, LAYER_RAM};
+	for(uint8_t i = 0; i < dataNum; i++)
+		layers[2 + i] = data[i];
+	sendIPv4packet(dest, &localIP, PROTO_TCP, sizeof(pkt) + optionsLen + dataLen, 2 + dataNum, layers);
+}
+
+// Called from handleTimers() when a stream's timer runs out
+static void TCPtimerExpired(void *const arg) {
+	struct Stream *const s = arg;
+	switch(s->state) {
+		case SYN_SENT: // No SYN-ACK yet
+			if(s->retries >= TCP_MAX_SYN_RETRIES)
+				s->state = CLOSED; // Nobody is there, connected() reports the failure
+			else {
+				s->retries++;
+				s->tcb.rto = s->tcb.rto > TCP_RTO_MAX / 2 ? TCP_RTO_MAX : s->tcb.rto * 2; // RFC 6298 5.5, back off the timer
+				uint8_t options[TCP_SYN_OPTIONS];
+				sendTCPpacket(s, -1, 0, SYN, options, buildSYNoptions(options, 1, 1, 1, 0), 0, NULL);
+				timerArm(&s->timer, s->tcb.rto);
+			}
+			break;
+		case FIN_WAIT_2: // Gave up waiting for their FIN
+			releaseStream(s);
+			break;
+		// Retransmit timer expired while in a state where they haven't ACKed all our data or our FIN
+		case ESTABLISHED:
+		case FIN_WAIT_1:
+		case CLOSING:
+		case CLOSE_WAIT:
+		case LAST_ACK:
+			if(s->tcb.segCount > 0) {
+				if(SEGMENT(s, 0)->retransmits >= TCP_MAX_RETRANSMITS) { // The peer is gone
+					if(s->state == ESTABLISHED || s->state == CLOSE_WAIT)
+						s->state = CLOSED; // Like a RST, the user sees this on their next recv() or send()
+					else
+						releaseStream(s); // The user already closed this stream
+					break;
+				}
+				if(SEGMENT(s, 0)->retransmits == 0) // RFC 5681 3.1, a repeated timeout of the same segment keeps ssthresh
+					congestionLoss(s, s->tx.next - s->tx.tail);
+				s->tcb.cwnd = s->tcb.mss; // Back to slow start from one segment
+				s->tcb.dupACKs = 0;
+				s->inRecovery = 0;
+				for(uint8_t i = 0; i < s->tcb.segCount; i++)
+					SEGMENT(s, i)->lost = 1; // Anything still unACKed is presumed lost, and resent one per ACK
+				retransmitLost(s); // Resend the oldest segment they haven't SACKed
+				s->tcb.rto = s->tcb.rto > TCP_RTO_MAX / 2 ? TCP_RTO_MAX : s->tcb.rto * 2; // RFC 6298 5.5, back off the timer
+				timerArm(&s->timer, s->tcb.rto);
 			}
-			// If retransmit timer expired while in a state where they haven't ACKed our FIN
-			else if((streams[i].state == ESTABLISHED || streams[i].state == FIN_WAIT_1 || streams[i].state == CLOSING 
-				   || streams[i].state == CLOSE_WAIT || streams[i].state == LAST_ACK)  && RTCtimerDone(streams[i].timer)) { 
-				streams[i].timer = RTCsetTimer(RETRANSMIT_PERIOD);
-				sendWhatWeCan(i);
+			else if(s->tx.window == 0 && s->tx.next < s->tx.head) { // Persist timer, their window is still closed
+				if(s->retries >= TCP_MAX_RETRANSMITS && (s->state == FIN_WAIT_1 || s->state == LAST_ACK)) {
+					releaseStream(s); // The user already closed this stream, don't hold on to it forever
+					break;
+				}
+				if(s->retries < TCP_MAX_RETRANSMITS)
+					s->retries++;
+				// Already ACKed sequence number, so the peer answers with an ACK carrying its current window
+				sendTCPpacket(s, s->tx.tail - 1, rcvNext(s), ACK, NULL, 0, 0, NULL);
+				const uint32_t timeout = (uint32_t)s->tcb.rto << s->retries; // Back off like the retransmit timer
+				timerArm(&s->timer, timeout > TCP_RTO_MAX ? TCP_RTO_MAX : timeout);
+				break;
 			}
-		}
+			sendWhatWeCan(s - streams, 0);
+			break;
+		default:
+			break;
 	}
 }
 
-static const void *getTCPoption(const uint8_t *const options, const uint8_t num) { // Returns address of length byte of that option
-	for(uint16_t i = 0; options[i] != 0x00; i++)
+// Called from handleTimers() when we held back an ACK and no data went out to carry it
+static void TCPdelayedACK(void *const arg) {
+	struct Stream *const s = arg;
+	if(s->ackPending && (s->state == ESTABLISHED || s->state == FIN_WAIT_1 || s->state == FIN_WAIT_2))
+		sendTCPpacket(s, s->tx.next, rcvNext(s), ACK, NULL, 0, 0, NULL);
+}
+
+// Sends one cumulative ACK for every stream that received segments during this packetHandler() call and
+// hasn't already had the ACK carried on something else we sent. Called once the NIC has no more frames pending.
+void TCPflushACKs(void) {
+	for(uint8_t i = 0; i < MAX_STREAMS; i++)
+		if(streams[i].inUse && streams[i].ackNow)
+			sendTCPpacket(&streams[i], streams[i].tx.next, rcvNext(&streams[i]), ACK, NULL, 0, 0, NULL);
+}
+
+// The next sequence number we expect from the peer, which is one past their FIN once we've received it
+static uint32_t rcvNext(const struct Stream *const s) {
+	switch(s->state) {
+		case CLOSE_WAIT:
+		case LAST_ACK:
+		case CLOSING:
+		case TIME_WAIT:
+			return s->rx.head + 1;
+		default:
+			return s->rx.head;
+	}
+}
+
+// One past the last byte in the TX buffer, where flash data from TCPsendProgmem() starts if there is any
+static RING_INDEX txRingEnd(const struct Stream *const s) {
+	return s->tcb.progmemLen > 0 ? s->tcb.progmemStart : s->tx.head;
+}
+
+// One past the last byte in the RX buffer, which is past head if there is out-of-order data
+static uint32_t rxEnd(const struct Stream *const s) {
+	return s->tcb.oooCount > 0 ? s->tcb.ooo[s->tcb.oooCount - 1].end : s->rx.head;
+}
+
+// Moves rx.rawseq forward once the reader is far enough along, so the RX indices never wrap.
+// Everything still in use is within about a buffer's length of tail, so no index goes below zero.
+static void rebaseRX(struct Stream *const s) {
+	if(s->rx.tail < INDEX_REBASE_AT)
+		return;
+	s->rx.rawseq += INDEX_REBASE;
+	s->rx.head -= INDEX_REBASE;
+	s->rx.tail -= INDEX_REBASE;
+	s->tcb.windowEnd -= INDEX_REBASE;
+	s->tcb.lastACK -= INDEX_REBASE;
+	for(uint8_t i = 0; i < s->tcb.oooCount; i++) {
+		s->tcb.ooo[i].start -= INDEX_REBASE;
+		s->tcb.ooo[i].end -= INDEX_REBASE;
+	}
+}
+
+// The same for the TX indices, once the peer has ACKed far enough
+static void rebaseTX(struct Stream *const s) {
+	if(s->tx.tail < INDEX_REBASE_AT)
+		return;
+	s->tx.rawseq += INDEX_REBASE;
+	s->tx.head -= INDEX_REBASE;
+	s->tx.tail -= INDEX_REBASE;
+	s->tx.next -= INDEX_REBASE;
+	s->tcb.recover -= INDEX_REBASE;
+	for(uint8_t i = 0; i < s->tcb.sackedCount; i++) {
+		s->tcb.sacked[i].start -= INDEX_REBASE;
+		s->tcb.sacked[i].end -= INDEX_REBASE;
+	}
+	for(uint8_t i = 0; i < s->tcb.segCount; i++)
+		SEGMENT(s, i)->start -= INDEX_REBASE;
+	if(s->tcb.progmemLen > 0)
+		s->tcb.progmemStart -= INDEX_REBASE;
+}
+
+// Returns a stream to the pool, making sure its timers can't fire after it is reused
+static void releaseStream(struct Stream *const s) {
+	timerCancel(&s->timer);
+	timerCancel(&s->ackTimer);
+	ringTrim(s->rx.chunks, STREAM_RX_SIZE, 0, 0);
+	ringTrim(s->tx.chunks, STREAM_TX_SIZE, 0, 0); // Give all their chunks back
+	s->ackNow = 0;
+	s->state = CLOSED;
+	s->inUse = 0;
+}
+
+static const void *getTCPoption(const struct TCPheader *const tcp, const uint8_t num) { // Returns address of length byte of that option
+	const uint8_t *const options = (uint8_t *)tcp + sizeof(struct TCPheader);
+	const uint8_t optionsLen = tcp->offset > 5 ? tcp->offset * 4 - sizeof(struct TCPheader) : 0; // Don't look into the payload
+	for(uint8_t i = 0; i < optionsLen && options[i] != 0x00; i++)
 		if(options[i] != 0x01) { // if not padding
+			if(i + 1 >= optionsLen || options[i+1] < 2 || i + options[i+1] > optionsLen)
+				break; // Malformed option, or one running past the header, give up
 			if(options[i] == num) // the option we're looking for
 				return &options[i+1]; // Return address of next val which is length of option
 			else 
@@ -291,15 +1341,55 @@ static uint16_t checksumC(const uint8_t data[], const uint16_t lenBytes) {
 	return ~running;
 }
 
+// Adds len bytes to a running checksum. Unlike checksumUpdate(), len may be odd, and the data may start
+// at an odd offset in the packet (after an odd length piece), in which case its bytes pair up the other way around.
+static uint16_t checksumSpan(const uint16_t context, const struct Layer *const span, const uint8_t oddOffset) {
+	uint32_t sum = 0;
+	if(span->source == LAYER_NIC) { // Let the ENC28J60 add it up where it is, it pads an odd length with a zero too
+		if(span->len > 0) {
+			DMAchecksum((uintptr_t)span->data, (uintptr_t)span->data + span->len - 1);
+			sum = (uint16_t)~getChecksum();
+		}
+	}
+	else if(span->source == LAYER_FLASH) {
+		const uint8_t *const data = span->data;
+		for(uint16_t i = 0; i < span->len; i += 2) {
+			sum += (uint16_t)pgm_read_byte(&data[i]) << 8;
+			if(i + 1 < span->len)
+				sum += pgm_read_byte(&data[i + 1]); // The last byte is padded with a zero
+		}
+		while(sum > 0xFFFF)
+			sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	else {
+		const uint8_t *const data = span->data;
+		sum = checksumUpdate(0, data, span->len & ~1);
+		if(span->len & 1)
+			sum += (uint16_t)data[span->len - 1] << 8; // The last byte is padded with a zero
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	if(oddOffset)
+		sum = ((sum << 8) | (sum >> 8)) & 0xFFFF; // Ones' complement sums can be byte swapped after the fact
+	sum += context;
+	return (sum & 0xFFFF) + (sum >> 16);
+}
+
 static uint16_t TCPchecksum(const struct IPv4 *const restrict destIP, const struct TCPheader *const restrict tcp, 
-							const uint8_t options[], const uint8_t optionsLen, const uint8_t data[], const uint16_t dataLen) {
+							const uint8_t options[], const uint8_t optionsLen, const uint8_t dataNum, const struct Layer data[]) {
+	uint16_t dataLen = 0;
+	for(uint8_t i = 0; i < dataNum; i++)
+		dataLen += data[i].len;
 	struct TCPpseudoHeader pseudo = {.srcIP = localIP, .destIP = *destIP, .zero = 0, .protocol = PROTO_TCP, 
 									 .length = sizeof(struct TCPheader) + optionsLen + dataLen};
 	uint16_t checksum = 0;
 	checksum = checksumUpdate(checksum, &pseudo, sizeof(pseudo));
 	checksum = checksumUpdate(checksum, tcp, sizeof(struct TCPheader));
-	checksum = checksumUpdate(checksum, options, optionsLen);
-	checksum = checksumUpdate(checksum, data, dataLen);
+	checksum = checksumUpdate(checksum, options, optionsLen); // Options are always a multiple of 4 bytes
+	uint16_t offset = 0;
+	for(uint8_t i = 0; i < dataNum; i++) {
+		checksum = checksumSpan(checksum, &data[i], offset & 1);
+		offset += data[i].len;
+	}
 	return ~checksum;
 	/*
 	uint8_t checksumData[sizeof(struct TCPpseudoHeader) + sizeof(struct TCPheader) + optionsLen + dataLen];
@@ -6,59 +6,138 @@ extern "C" {
 #endif
 
 #define MAX_SOCKETS 2 // Maximum number of sockets we will allow open at once
-#define MAX_STREAMS 5 // Maximum number of streams total on the device
-// The following must be powers of two
-#define STREAM_RX_SIZE 1024 // Length in bytes of each statically allocated RX stream buffer
-#define STREAM_TX_SIZE 512 // Length in bytes of each statically allocated TX stream buffer
+#define MAX_STREAMS 16 // Maximum number of streams total on the device
+#define MAX_HALF_OPEN 8 // Maximum number of TCP connections being accepted at once, across all listening sockets
+#define DEFAULT_BACKLOG 4 // How many of those each listening socket may have, unless changed with SO_BACKLOG
+// The following must be powers of two. Buffers take chunks from the pool in Ring.h as they fill up.
+#define STREAM_RX_SIZE 1024 // Length in bytes of each RX stream buffer
+#define STREAM_TX_SIZE 512 // Length in bytes of each TX stream buffer
 
-#define TIME_WAIT_SECONDS 10 // How many seconds TCP streams remain in TIME_WAIT before closing
+#define TIME_WAIT_SECONDS 10 // How many seconds closed TCP connections remain in TIME_WAIT
+#define MAX_TIME_WAIT 8 // Maximum number of TCP connections in TIME_WAIT, they don't take up streams
+#define SACK_BLOCKS 3 // How many out-of-order ranges we track in each direction for selective acknowledgement
+#define TX_SEGMENTS 8 // How many sent but unacknowledged segments each stream remembers, must be a power of two
 
 #define RX_MASK (STREAM_RX_SIZE - 1)
 #define TX_MASK (STREAM_TX_SIZE - 1)
+// Ring indices are offsets from a 32-bit base (rawseq in TCP mode). Once tail reaches INDEX_REBASE_AT,
+// INDEX_REBASE is taken off every index of that direction and added to its base, so the indices never wrap.
+// INDEX_REBASE must be a multiple of both buffer sizes, so every index stays in the same place in the ring.
+// Everything in use is within about a buffer's length of tail, so 16 bits are enough while both buffers are
+// at most 4 KB. Bigger buffers, which TCP window scaling allows, get 32-bit indices.
+#if STREAM_RX_SIZE > 0x1000 || STREAM_TX_SIZE > 0x1000
+#define RING_INDEX uint32_t
+#define INDEX_REBASE_AT 0x80000000UL
+#define INDEX_REBASE 0x40000000UL
+#else
+#define RING_INDEX uint16_t
+#define INDEX_REBASE_AT 0x8000U
+#define INDEX_REBASE 0x4000U
+#endif
 
 enum __attribute__((packed)) TCPstate {UDP_MODE, CLOSED, LISTEN, SYN_SENT, SYN_RECEIVED, ESTABLISHED, \
 		CLOSE_WAIT, LAST_ACK, FIN_WAIT_1, FIN_WAIT_2, CLOSING, TIME_WAIT};
 
+struct SACKblock
+{
+	RING_INDEX start; // First byte of the range, relative to rawseq like head and tail
+	RING_INDEX end; // One past the last byte of the range
+};
+
+struct TXsegment
+{
+	RING_INDEX start; // Relative sequence number of the first byte, like the TX indices
+	uint16_t len;
+	uint16_t sent; // Low 16 bits of now_ms() when this segment was last sent
+	uint8_t retransmits : 6, // How many times it was resent, RTT is not sampled from resent segments (Karn's rule)
+			lost : 1, // Set on timeout, cleared when it is resent
+			fin : 1; // Our FIN is on this segment, taking up one sequence number after the data
+};
+
+// The ring buffers, which every byte sent or received goes through. The TCP state that is only looked at
+// once per segment is in struct TCB, after these in the stream, so these stay close to the start of it.
 struct RX
 {
-	uint32_t head; // Even though 32 bits is much larger than we need for an array index,
-	uint32_t tail; // they should be this big since we do arithmetic with them and raw 32 bit sequence numbers 
-	uint32_t rawseq; // In TCP mode, the raw sequence number received in the last ACK of the handshake
-	uint8_t buf[STREAM_RX_SIZE];
+	RING_INDEX head; // Offsets from rawseq, they are rebased before they could wrap (see INDEX_REBASE)
+	RING_INDEX tail;
+	uint32_t rawseq; // In TCP mode, the raw sequence number head and tail are relative to
+	uint8_t chunks[STREAM_RX_SIZE / CHUNK_SIZE]; // Pool chunk holding each piece of the buffer, 0 if none
 };
 
 struct TX
 {
-	uint32_t head;
-	uint32_t tail; // In TCP mode, this points to first byte of sent but unacknowledged data (everything behind it is ACKed)
-	uint32_t next; // In TCP mode, this points to the first byte of unsent data that has been written by user
+	RING_INDEX head;
+	RING_INDEX tail; // In TCP mode, this points to first byte of sent but unacknowledged data (everything behind it is ACKed)
+	RING_INDEX next; // In TCP mode, this points to the first byte of unsent data that has been written by user, or head + 1 after our FIN
+	uint32_t rawseq; // In TCP mode, the raw sequence number head, tail and next are relative to
 	uint32_t window; // In TCP mode, the current send window
-	uint32_t rawseq; // In TCP mode, the raw sequence number of the last sent packet
-	uint16_t scale; // Window scaling
-	uint8_t buf[STREAM_TX_SIZE];
+	uint8_t chunks[STREAM_TX_SIZE / CHUNK_SIZE]; // Pool chunk holding each piece of the buffer, 0 if none
 };
 // Initially head = tail = next. User calls send, moves head pointer. 
 // Driver sends it, moves next pointer. Receives ACK, moves tail pointer
 
+// The rest of a TCP connection's state. Sequence numbers here are relative like the ring indices, rx.rawseq for
+// what we receive and tx.rawseq for what we send.
+struct TCB
+{
+	struct SACKblock ooo[SACK_BLOCKS]; // Out-of-order data already written in the RX buffer past head, sorted by start
+	uint8_t oooCount; // Number of valid entries in ooo
+	uint8_t oooRecent; // Index in ooo of the block holding the most recently received segment
+	RING_INDEX windowEnd; // Right edge of the last window we advertised
+	RING_INDEX lastACK; // The last acknowledgement number we sent
+	uint32_t tsRecent; // With timestamps, their timestamp we echo back (TS.Recent in RFC 7323)
+	uint16_t mss; // The largest segment the peer accepts, from its MSS option
+	uint8_t scale; // Window scale shift of the peer's window field (RFC 7323), 0 without window scaling
+	struct SACKblock sacked[SACK_BLOCKS]; // Ranges between tx.tail and tx.next the peer has selectively ACKed, sorted by start
+	uint8_t sackedCount; // Number of valid entries in sacked
+	struct TXsegment segs[TX_SEGMENTS]; // Retransmit queue of segments between tx.tail and tx.next, oldest first
+	uint8_t segFirst; // Index in segs of the oldest segment
+	uint8_t segCount; // Number of segments in the queue
+	uint16_t srtt; // Smoothed round trip time in ms, times 8. Zero until the first sample
+	uint16_t rttvar; // Round trip time variation in ms, times 4
+	uint16_t rto; // Current retransmission timeout in ms, including backoff
+	uint32_t cwnd; // Congestion window in bytes, we never have more than this in flight (RFC 5681)
+	uint32_t ssthresh; // Slow start below this congestion window, congestion avoidance above it
+	RING_INDEX recover; // Fast recovery ends once everything up to here is ACKed (RFC 6582)
+	uint8_t dupACKs; // Duplicate ACKs in a row
+	const void *progmem; // Flash data given to TCPsendProgmem(), sent from where it is and kept until it is all ACKed
+	RING_INDEX progmemStart; // Where it starts, the data in the TX buffer ends here and tx.head is past the flash data
+	uint16_t progmemLen; // 0 if there is none
+};
+
+// Fields are in order of how often they are used, on the AVR the first 64 bytes can be reached straight from the pointer
 struct Stream
 {
 	uint8_t inUse : 1,
-			accepted : 1;
+			accepted : 1,
+			sackPermitted : 1, // Both ends sent the SACK-permitted option in the handshake
+			windowScaling : 1, // Both ends sent the window scale option in the handshake
+			ackPending : 1, // We received data and are delaying the ACK for it
+			ackNow : 1, // An ACK must go out at the end of the current packetHandler() batch
+			finPending : 1, // The user closed the stream, FIN goes out with the last data in the TX buffer
+			inRecovery : 1, // In NewReno fast recovery after a fast retransmit
+			timestamps : 1; // Both ends sent the timestamps option in the handshake
 	enum TCPstate state; // Holds TCP state or UDP
 	int8_t parent; // Index of the socket using this stream
-	int8_t timer; // Used for TIME_WAIT timer
-	uint16_t remotePort;
-	struct IPv4 remoteIP; // Address and port of who this stream is communicating with
 	struct RX rx;
 	struct TX tx; // RX and TX ring buffers
+	uint16_t localPort; // Port of the listening socket, or the ephemeral port connect() picked
+	uint16_t remotePort;
+	struct IPv4 remoteIP; // Address and port of who this stream is communicating with
+	uint8_t retries; // In TCP mode, how many times our SYN was resent, then how many window probes went unanswered by an open window
+	struct WheelTimer timer; // Used for retransmission, handshake and FIN_WAIT_2 timeouts
+	struct WheelTimer ackTimer; // Delayed ACK timer
+	struct TCB tcb; // Not used in UDP mode
 };
 
 struct Socket 
 {
 	uint16_t port; // Local port of this socket
 	uint8_t protocol; // TCP or UDP
+	uint8_t backlog; // Most half-open TCP connections this listening socket may have at once
 	uint8_t inUse : 1,
-			listening : 1; // If this is a listening socket or not
+			listening : 1, // If this is a listening socket or not
+			noDelay : 1; // TCP_NODELAY, send small segments right away instead of coalescing them
 };
 
 extern struct Socket sockets[MAX_SOCKETS]; // Where we store our socket descriptors
@@ -66,9 +145,18 @@ extern struct Stream streams[MAX_STREAMS]; // Our pool of streams that sockets c
 
 extern void TCPprocessor(struct Stream *const restrict stream, const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp);
 extern int16_t TCPrecv(const int8_t stream, void *const dest, const int16_t buflen, const uint8_t flags);
+extern int16_t TCPpeek(const int8_t stream, struct Layer spans[], const uint8_t maxSpans, const uint8_t flags);
+extern void TCPconsume(const int8_t stream, uint16_t len);
 extern int16_t TCPsend(const int8_t stream, const void *const src, const int16_t buflen, const uint8_t flags);
+extern int16_t TCPsendProgmem(const int8_t stream, const void *const src, const int16_t len, const uint8_t flags);
+extern int16_t TCPsendv(const int8_t stream, const struct Layer layers[], const uint8_t num, const uint8_t flags);
+extern void TCPconnect(const int8_t stream);
+extern void TCPlisten(const int8_t socket, const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp);
+extern uint8_t TCPtimeWait(const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp);
+extern uint8_t TCPinTimeWait(const uint16_t localPort, const struct IPv4 *const remoteIP, const uint16_t remotePort);
+extern void TCPreset(const struct IPv4header *const restrict ip, const struct TCPheader *const restrict tcp);
 extern void TCPclose(const int8_t stream);
-extern void handleTCPtimers(void);
+extern void TCPflushACKs(void);
 
 #ifdef __cplusplus
 }
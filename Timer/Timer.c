@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "Timer.h"
+
+#ifndef F_CPU
+#error "F_CPU"
+#endif
+
+#if F_CPU / 64 / 1000 > 256 || F_CPU / 64 / 1000 < 1
+#error "Timer 0 can't make a 1 ms tick from this F_CPU with a prescaler of 64"
+#endif
+
+#if WHEEL_BITS * WHEEL_LEVELS > 31
+#error "Timer wheel too big"
+#endif
+
+#define WHEEL_SLOTS (1U << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) (1UL << (WHEEL_BITS * ((level) + 1))) // How many ms ahead a timer can be on this level
+
+#define disableTickInt() (TIMSK0 = 0) // disable tick interrupt
+#define enableTickInt() (TIMSK0 = 1 << OCIE0A) // enable tick interrupt
+
+static volatile uint32_t ticks = 0; // Milliseconds since TimerInit()
+static uint32_t wheelTime = 0; // Last millisecond whose timers have been run by handleTimers()
+static struct WheelTimer *wheel[WHEEL_LEVELS][WHEEL_SLOTS] = {{NULL}};
+
+static void wheelInsert(struct WheelTimer *const t);
+static void cascade(const uint8_t level);
+
+void TimerInit(void)
+{
+	disableTickInt();
+	TCCR0A = 1 << WGM01; // Clear timer on compare match mode
+	TCCR0B = (1 << CS01) | (1 << CS00); // Prescaler at 64
+	OCR0A = F_CPU / 64 / 1000 - 1; // With 8 MHz this is 124, which gives exactly one compare match every millisecond
+	TCNT0 = 0;
+	enableTickInt();
+	sei();
+}
+
+uint32_t now_ms(void)
+{
+	disableTickInt(); // A tick that happens now is held pending, not lost
+	const uint32_t now = ticks;
+	enableTickInt();
+	return now;
+}
+
+// Must be called once on a timer before it is armed
+void timerSetup(struct WheelTimer *const t, void (*const callback)(void *const arg), void *const arg)
+{
+	t->next = NULL;
+	t->prev = NULL;
+	t->callback = callback;
+	t->arg = arg;
+}
+
+// Starts the timer so it expires the given number of milliseconds from now, replacing any previous expiry
+void timerArm(struct WheelTimer *const t, const uint32_t ms)
+{
+	timerCancel(t);
+	t->expires = now_ms() + ms;
+	if((int32_t)(t->expires - wheelTime) <= 0) // That millisecond was already run, so use the next one
+		t->expires = wheelTime + 1;
+	wheelInsert(t);
+}
+
+void timerCancel(struct WheelTimer *const t)
+{
+	if(t->prev != NULL) { // Unlink it from its slot
+		*t->prev = t->next;
+		if(t->next != NULL)
+			t->next->prev = t->prev;
+		t->prev = NULL;
+	}
+}
+
+uint8_t timerArmed(const struct WheelTimer *const t)
+{
+	return t->prev != NULL;
+}
+
+// Runs the callbacks of every timer that expired since the last call
+void handleTimers(void)
+{
+	const uint32_t now = now_ms();
+	while(wheelTime != now) {
+		wheelTime++;
+		// When a lower level wraps around, move the timers in the next slot of the level above down
+		for(uint8_t level = WHEEL_LEVELS - 1; level > 0; level--)
+			if((wheelTime & (WHEEL_SPAN(level - 1) - 1)) == 0)
+				cascade(level);
+		struct WheelTimer **const slot = &wheel[0][wheelTime & WHEEL_MASK];
+		while(*slot != NULL) {
+			struct WheelTimer *const t = *slot;
+			timerCancel(t); // Unlink it first so the callback can arm it again
+			t->callback(t->arg);
+		}
+	}
+}
+
+// Places an unlinked timer in the slot for its expiry, on the lowest level that reaches that far
+static void wheelInsert(struct WheelTimer *const t)
+{
+	uint32_t when = t->expires;
+	if((int32_t)(when - wheelTime) < 0)
+		when = wheelTime; // Overdue timers brought down by a cascade go in the slot about to be run
+	uint8_t level = 0;
+	while(level < WHEEL_LEVELS - 1 && when - wheelTime >= WHEEL_SPAN(level))
+		level++;
+	if(when - wheelTime >= WHEEL_SPAN(level)) // Too far for the wheel, it will be placed again when this slot cascades
+		when = wheelTime + WHEEL_SPAN(level) - 1;
+	struct WheelTimer **const slot = &wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	t->next = *slot;
+	if(t->next != NULL)
+		t->next->prev = &t->next;
+	*slot = t;
+	t->prev = slot;
+}
+
+static void cascade(const uint8_t level)
+{
+	struct WheelTimer **const slot = &wheel[level][(wheelTime >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	struct WheelTimer *t = *slot;
+	*slot = NULL; // Take the whole list out, then place each timer again relative to the new wheelTime
+	while(t != NULL) {
+		struct WheelTimer *const next = t->next;
+		wheelInsert(t);
+		t = next;
+	}
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+	ticks++;
+}
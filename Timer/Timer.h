@@ -0,0 +1,45 @@
+#ifndef TIMER_H 
+#define TIMER_H
+#ifdef __cplusplus
+#define restrict __restrict__
+extern "C" {
+#endif
+/*
+This library provides a monotonic millisecond clock driven by the Timer 0 peripheral, and a
+hierarchical timer wheel on top of it. Timers are handles that can be embedded in other structs,
+arming and cancelling them is O(1), and their callbacks are run from handleTimers(), which must be
+called from the main loop (packetHandler() does this), never from an interrupt.
+*/
+
+#define WHEEL_BITS 5 // Each level of the wheel has 2^WHEEL_BITS slots
+#define WHEEL_LEVELS 3 // Timers up to 2^(WHEEL_BITS * WHEEL_LEVELS) ms away are placed directly, longer ones cascade again
+
+struct WheelTimer
+{
+	struct WheelTimer *next;
+	struct WheelTimer **prev; // Points to whatever points to us in the wheel, NULL when the timer is not armed
+	uint32_t expires; // Value of now_ms() at which the callback is run
+	void (*callback)(void *const arg);
+	void *arg;
+};
+
+/*
+Usage of the functions:
+TimerInit();
+timerSetup(&t, callback, arg); // Once, before the first timerArm()
+timerArm(&t, 250); // callback(arg) is run from handleTimers() 250 ms from now
+timerCancel(&t);
+*/
+
+extern void TimerInit(void);
+extern uint32_t now_ms(void);
+extern void timerSetup(struct WheelTimer *const t, void (*const callback)(void *const arg), void *const arg);
+extern void timerArm(struct WheelTimer *const t, const uint32_t ms);
+extern void timerCancel(struct WheelTimer *const t);
+extern uint8_t timerArmed(const struct WheelTimer *const t);
+extern void handleTimers(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // TIMER_H
@@ -12,6 +12,8 @@
 #include "ARP/ARP.h"
 #include "Checksum/Checksum.h"
 #include "DHCP/DHCP.h"
+#include "Timer/Timer.h"
+#include "Ring/Ring.h"
 #include "Socket/Socket.h"
 #include "WebserverDriver.h"
 
@@ -30,7 +32,7 @@
 #if (RX_MASK & STREAM_RX_SIZE)
 #error "RX stream buffer not power of two"
 #endif
-#if STREAM_RX_SIZE > 32768
+#if STREAM_RX_SIZE > (1UL << 20) // TCP window scaling lets bigger buffers be used, up to what TCP_RX_WSCALE covers
 #error "RX stream too big"
 #endif
 #if (TX_MASK & STREAM_TX_SIZE)
@@ -39,6 +41,12 @@
 #if STREAM_TX_SIZE > 32768
 #error "TX stream too big"
 #endif
+#if CHUNK_SIZE > STREAM_TX_SIZE || CHUNK_SIZE > STREAM_RX_SIZE
+#error "Ring chunks bigger than the stream buffers"
+#endif
+#if (TX_SEGMENTS & (TX_SEGMENTS - 1)) || TX_SEGMENTS > 128
+#error "TX segment queue length not a power of two"
+#endif
 
 
 #define STACK_HIGH *(const volatile uint8_t *)0x5E
@@ -50,6 +58,10 @@ static void ICMPv4processor(const void *const restrict ip, const void *const res
 static void Layer3processor(const void *const restrict ip, const void *const restrict layer3);
 static void incomingMessage(const struct IPv4header *const restrict ip, const void *const restrict layer3);
 static void writeRX(struct Stream *const restrict stream, const struct IPv4header *const restrict ip, const void *const restrict layer3);
+static uint16_t ephemeralPort(const struct IPv4 *const remoteIP, const uint16_t remotePort);
+static void sendPortUnreachable(const struct IPv4header *const ip);
+static int16_t datagramLength(const struct RX *const rx);
+static void dropDatagram(struct RX *const rx);
 
 const struct IPv4 broadcastIP = {{255, 255, 255, 255}};
 
@@ -104,7 +116,7 @@ void packetHandler(void) {
 		const uint16_t frameSize = getFrameSize();
 		if(frameSize == 0) {
 			printf("Bad frame size\n");
-			return;
+			break;
 		}
 		else
 			printf("Frame size: %u ", frameSize);
@@ -123,7 +135,8 @@ void packetHandler(void) {
 				break;
 		}
 	}
-	handleTCPtimers();
+	TCPflushACKs(); // ACKs and window updates for the whole batch of frames go out together
+	handleTimers();
 	handleDHCPtimers();
 }
 
@@ -143,6 +156,8 @@ int8_t socket(const uint8_t protocol) {
 			sockets[i].port = 0; // Not assigned yet
 			sockets[i].protocol = protocol;
 			sockets[i].listening = 0; // Not listening yet
+			sockets[i].noDelay = 0; // Nagle's algorithm on by default
+			sockets[i].backlog = DEFAULT_BACKLOG;
 			sockets[i].inUse = 1;
 			return i;
 		}
@@ -159,13 +174,35 @@ int8_t bindlisten(const int8_t socket, const uint16_t port) {
 	return -1;
 }
 
-int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *const destIP) {
+int8_t setsockopt(const int8_t socket, const uint8_t option, const uint8_t value) {
+	if(socket < MAX_SOCKETS && socket >= 0 && sockets[socket].inUse) {
+		switch(option) {
+			case TCP_NODELAY:
+				sockets[socket].noDelay = value != 0;
+				return 0;
+			case SO_BACKLOG:
+				sockets[socket].backlog = value;
+				return 0;
+			default:
+				break;
+		}
+	}
+	return -1;
+}
+
+int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *const destIP, const uint8_t flags) {
 	if(socket < MAX_SOCKETS && socket >= 0 && sockets[socket].inUse && !sockets[socket].listening) {
-		sockets[socket].port = 32876; // Some random local port number
 		// Now we need to allocate a stream for this socket
 		for(int8_t i = 0; i < MAX_STREAMS; i++) {
 			if(!streams[i].inUse) { // Look for an unused stream
 				streams[i].parent = socket; // Set this stream's parent so we can find the source port
+				if(sockets[socket].protocol == PROTO_TCP)
+					streams[i].localPort = ephemeralPort(destIP, port); // Each TCP connection gets its own
+				else {
+					if(sockets[socket].port == 0)
+						sockets[socket].port = ephemeralPort(NULL, 0); // UDP has no TIME_WAIT to avoid
+					streams[i].localPort = sockets[socket].port;
+				}
 				streams[i].remotePort = port;
 				streams[i].remoteIP = *destIP;
 				streams[i].rx.head = 0;
@@ -175,8 +212,15 @@ int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *cons
 				streams[i].accepted = 1; // Set flag so that accept() will never return it
 				streams[i].inUse = 1;
 				if(sockets[socket].protocol == PROTO_TCP) {
-					//streams[i].state = TCP;
-					// Send TCP SYN
+					TCPconnect(i); // Send our SYN
+					if(flags & MSG_DONTWAIT)
+						return i; // The handshake finishes in the background, see connected()
+					while(streams[i].state == SYN_SENT)
+						packetHandler(); // Process more packets until the handshake is done
+					if(connected(i) < 0) {
+						closeStream(i); // Refused or timed out
+						return -1;
+					}
 				}
 				else
 					streams[i].state = UDP_MODE;
@@ -187,6 +231,42 @@ int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *cons
 	return -1;
 }
 
+int8_t connected(const int8_t stream) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted) {
+		switch(streams[stream].state) {
+			case SYN_SENT:
+				return 0;
+			case CLOSED:
+				return -1;
+			default: // We can send, or at least receive what they sent before closing
+				return 1;
+		}
+	}
+	return -1;
+}
+
+// Picks a local port from the dynamic range (RFC 6335) that no socket or stream is using.
+// For a TCP connection to remoteIP, it also can't be the port of a connection to it still in TIME_WAIT.
+static uint16_t ephemeralPort(const struct IPv4 *const remoteIP, const uint16_t remotePort) {
+	static uint16_t last = 0;
+	if(last < 49152)
+		last = 49152 + (rand() & 0x3FFF); // Random start, so we don't reuse the same ports after every reset
+	while(1) {
+		last = last == 65535 ? 49152 : last + 1;
+		uint8_t used = 0;
+		for(uint8_t i = 0; i < MAX_SOCKETS; i++)
+			if(sockets[i].inUse && sockets[i].port == last)
+				used = 1;
+		for(uint8_t i = 0; i < MAX_STREAMS; i++)
+			if(streams[i].inUse && streams[i].localPort == last)
+				used = 1;
+		if(remoteIP != NULL && TCPinTimeWait(last, remoteIP, remotePort))
+			used = 1; // The peer may still be in TIME_WAIT too, and would not answer our SYN with a SYN-ACK
+		if(!used) // There are far more ports than sockets and streams, so this always ends
+			return last;
+	}
+}
+
 int8_t accept(const int8_t socket, const uint8_t flags) {
 	if(socket < MAX_SOCKETS && socket >= 0 && sockets[socket].inUse && sockets[socket].listening) {
 		while(1) {
@@ -211,10 +291,13 @@ void closeSocket(const int8_t socket) {
 }
 
 void closeStream(const int8_t stream) {
-	if(stream < MAX_STREAMS && stream >= 0) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse) {
 		if(streams[stream].state != UDP_MODE)
-			TCPclose(stream);
-		streams[stream].inUse = 0;
+			TCPclose(stream); // TCP streams free themselves once the rest of the data and the close handshake are done
+		else {
+			ringTrim(streams[stream].rx.chunks, STREAM_RX_SIZE, 0, 0); // Drop any datagrams not read yet
+			streams[stream].inUse = 0;
+		}
 	}
 }
 
@@ -225,6 +308,7 @@ static void incomingMessage(const struct IPv4header *const restrict ip, const vo
 	for(uint8_t i = 0; i < MAX_STREAMS; i++) {
 		// See if stream is in use and has matching port, address, and protocol. The layer3 trick works for both UDP and TCP packets
 		if(streams[i].inUse && sockets[streams[i].parent].protocol == ip->protocol 
+			&& streams[i].localPort == PORTS(layer3)->destPort
 			&& streams[i].remotePort == PORTS(layer3)->srcPort
 			&& memcmp(&streams[i].remoteIP, &ip->srcIP, sizeof(struct IPv4)) == 0) {
 			printf("Enqueued packet from %u\n", streams[i].remotePort);
@@ -232,23 +316,27 @@ static void incomingMessage(const struct IPv4header *const restrict ip, const vo
 			return;
 		}
 	}
+	if(ip->protocol == PROTO_TCP && TCPtimeWait(ip, layer3))
+		return; // A late segment for a connection that is already closed
 	// If not, see if any sockets are listening for this port and protocol and if so, allocate a new stream and put it there
 	for(uint8_t i = 0; i < MAX_SOCKETS; i++) {
 		if(sockets[i].inUse && sockets[i].listening && sockets[i].protocol == ip->protocol
 			&& sockets[i].port == PORTS(layer3)->destPort) {
+			if(sockets[i].protocol == PROTO_TCP) {
+				TCPlisten(i, ip, layer3); // TCP only gets a stream once the handshake is done
+				return;
+			}
 			for(uint8_t j = 0; j < MAX_STREAMS; j++) {
 				if(!streams[j].inUse) { // Look for an unused stream
 					streams[j].parent = i; // Set this stream's parent so we can find the source port
+					streams[j].localPort = sockets[i].port;
 					streams[j].remotePort = PORTS(layer3)->srcPort;
 					streams[j].remoteIP = ip->srcIP;
 					streams[j].rx.head = 0;
 					streams[j].rx.tail = 0;
 					streams[j].tx.head = 0;
-					streams[j].tx.tail = 0; // Clear out ring buffers which is needed for both TCP and UDP
-					if(sockets[i].protocol == PROTO_UDP)
-						streams[j].state = UDP_MODE;
-					else // TCP mode
-						streams[j].state = LISTEN; 
+					streams[j].tx.tail = 0; // Clear out ring buffers
+					streams[j].state = UDP_MODE;
 					streams[j].accepted = 0; // No one has called accept and received this stream yet
 					streams[j].inUse = 1;
 					printf("New packet from %u.%u.%u.%u:%u to %u\n", ip->srcIP.addr[0], ip->srcIP.addr[1], ip->srcIP.addr[2], ip->srcIP.addr[3],
@@ -260,6 +348,24 @@ static void incomingMessage(const struct IPv4header *const restrict ip, const vo
 			return; // If we found a listening socket but not open stream, drop the packet
 		}
 	}
+	// Nobody has this port open, so tell them instead of letting them retry until they time out
+	if(ip->protocol == PROTO_TCP)
+		TCPreset(ip, layer3);
+	else
+		sendPortUnreachable(ip);
+}
+
+// Sends an ICMP port unreachable message (RFC 792, RFC 1122 3.2.2.1) about a datagram we have no socket for.
+// Never for datagrams sent to a broadcast or multicast address, or from an address nobody can answer.
+static void sendPortUnreachable(const struct IPv4header *const ip) {
+	if(memcmp(&ip->destIP, &localIP, sizeof(struct IPv4)) != 0 || ip->srcIP.addr[0] == 0 || ip->srcIP.addr[0] >= 224)
+		return;
+	const uint8_t quoteLen = ip->iht * 4 + 8; // Their IP header and the first 8 bytes of the datagram, i.e. the UDP header
+	struct ICMPv4header icmp = {.type = 3, .code = 3, .checksum = 0, .id = 0, .seq = 0}; // Destination unreachable, id and seq unused
+	icmp.checksum = ~checksumUpdate(checksumUpdate(0, &icmp, sizeof(icmp)), ip, quoteLen);
+	sendIPv4packet(&ip->srcIP, &localIP, PROTO_ICMPv4, sizeof(icmp) + quoteLen, 2, 
+				   LAYERS({&icmp, sizeof(icmp), LAYER_RAM},
+						  {ip, quoteLen, LAYER_RAM}));
 }
 
 static void writeRX(struct Stream *const restrict stream, const struct IPv4header *const restrict ip, const void *const restrict layer3) {
@@ -268,13 +374,17 @@ static void writeRX(struct Stream *const restrict stream, const struct IPv4heade
 		const uint8_t *const restrict payload = (uint8_t *)layer3 + sizeof(struct UDPheader);
 		// Uses zero-waste ring buffer https://www.snellman.net/blog/archive/2016-12-13-ring-buffers/
 		const uint16_t payloadLen = udp->length - sizeof(struct UDPheader);
-		if(STREAM_RX_SIZE - (stream->rx.head - stream->rx.tail) >= payloadLen + sizeof(uint16_t)) { // Ensure we have space for whole datagram
-			stream->rx.buf[stream->rx.head++ & RX_MASK] = payloadLen & 0xFF;
-			stream->rx.buf[stream->rx.head++ & RX_MASK] = payloadLen >> 8; // Write in datagram length first
+		const uint32_t end = stream->rx.head + sizeof(uint16_t) + payloadLen;
+		if((RING_INDEX)(STREAM_RX_SIZE - (stream->rx.head - stream->rx.tail)) >= payloadLen + sizeof(uint16_t) // Ensure we have space for whole datagram
+			&& ringReserve(stream->rx.chunks, STREAM_RX_SIZE, stream->rx.head, end, 0) == end) { // Also in the chunk pool
+			const uint8_t length[2] = {payloadLen & 0xFF, payloadLen >> 8};
+			ringWrite(stream->rx.chunks, STREAM_RX_SIZE, stream->rx.head, length, sizeof(length)); // Write in datagram length first
 			printf("Going to write %u bytes\n", payloadLen);
-			for(uint16_t i = 0; i < payloadLen; i++)
-				stream->rx.buf[stream->rx.head++ & RX_MASK] = payload[i]; // Write in datagram
+			ringWrite(stream->rx.chunks, STREAM_RX_SIZE, stream->rx.head + sizeof(length), payload, payloadLen); // Write in datagram
+			stream->rx.head = end;
 		}
+		else
+			ringTrim(stream->rx.chunks, STREAM_RX_SIZE, stream->rx.tail, stream->rx.head); // Drop it, and any chunks taken for it
 	}
 	else { // This is a TCP socket
 		TCPprocessor(stream, ip, (struct TCPheader *)layer3);
@@ -285,15 +395,11 @@ int16_t recv(const int8_t stream, void *const dest, const int16_t buflen, const
 	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted && buflen >= 0) {
 		if(streams[stream].state == UDP_MODE) { // UDP stream
 			while(1) {
-				if(streams[stream].rx.head != streams[stream].rx.tail) { // Is there a message waiting
-					int16_t length = streams[stream].rx.buf[streams[stream].rx.tail++ & RX_MASK]; // Get low byte
-					length |= (int16_t)streams[stream].rx.buf[streams[stream].rx.tail++ & RX_MASK] << 8; // Get high byte
-					for(int16_t i = 0; i < length; i++) {
-						if(i < buflen)
-							((uint8_t *)dest)[i] = streams[stream].rx.buf[streams[stream].rx.tail++ & RX_MASK];
-						else
-							streams[stream].rx.tail++; // Free buffer space anyway
-					}
+				struct RX *const rx = &streams[stream].rx;
+				if(rx->head != rx->tail) { // Is there a message waiting
+					const int16_t length = datagramLength(rx);
+					ringRead(rx->chunks, STREAM_RX_SIZE, rx->tail + sizeof(uint16_t), dest, buflen > length ? length : buflen);
+					dropDatagram(rx); // Free buffer space of the whole datagram anyway
 					return buflen > length ? length : buflen; // We wrote to user the minimum of these
 				}
 				else if(flags & MSG_DONTWAIT)
@@ -309,16 +415,71 @@ int16_t recv(const int8_t stream, void *const dest, const int16_t buflen, const
 	return -1;
 }
 
+int16_t recvpeek(const int8_t stream, struct Layer spans[], const uint8_t maxSpans, const uint8_t flags) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted && maxSpans > 0) {
+		if(streams[stream].state == UDP_MODE) { // UDP stream, the spans cover the next datagram
+			while(1) {
+				struct RX *const rx = &streams[stream].rx;
+				if(rx->head != rx->tail) { // Is there a message waiting
+					int16_t covered = 0;
+					const uint8_t count = ringSpans(rx->chunks, STREAM_RX_SIZE, rx->tail + sizeof(uint16_t), datagramLength(rx), spans, maxSpans);
+					for(uint8_t i = 0; i < count; i++)
+						covered += spans[i].len;
+					return covered;
+				}
+				else if(flags & MSG_DONTWAIT)
+					break; // return EWOULDBLOCK
+				else
+					packetHandler(); // Process more packets before checking streams again
+			}
+		}
+		else { // This is a TCP stream
+			return TCPpeek(stream, spans, maxSpans, flags);
+		}
+	}
+	return -1;
+}
+
+int8_t recvconsume(const int8_t stream, const uint16_t len) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted) {
+		if(streams[stream].state == UDP_MODE) { // Datagrams are only consumed whole
+			if(streams[stream].rx.head != streams[stream].rx.tail)
+				dropDatagram(&streams[stream].rx);
+		}
+		else
+			TCPconsume(stream, len);
+		return 0;
+	}
+	return -1;
+}
+
+// Length of the datagram at the tail of a UDP stream's RX buffer, which is written in front of it
+static int16_t datagramLength(const struct RX *const rx) {
+	uint8_t header[2];
+	ringRead(rx->chunks, STREAM_RX_SIZE, rx->tail, header, sizeof(header));
+	return header[0] | header[1] << 8; // Low byte first
+}
+
+// Frees the datagram at the tail of a UDP stream's RX buffer
+static void dropDatagram(struct RX *const rx) {
+	rx->tail += sizeof(uint16_t) + datagramLength(rx);
+	ringTrim(rx->chunks, STREAM_RX_SIZE, rx->tail, rx->head);
+	if(rx->tail >= INDEX_REBASE_AT) { // Keep the indices from wrapping, UDP has no sequence numbers to move
+		rx->head -= INDEX_REBASE;
+		rx->tail -= INDEX_REBASE;
+	}
+}
+
 int16_t send(const int8_t stream, const void *const src, const uint16_t buflen, const uint8_t flags) {
 	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted) {
 		if(streams[stream].state == UDP_MODE) { // In UDP just send it immediately
-			const struct UDPheader udp = {.srcPort = sockets[streams[stream].parent].port, 
+			const struct UDPheader udp = {.srcPort = streams[stream].localPort, 
 										  .destPort = streams[stream].remotePort, 
 									      .length = sizeof(udp) + buflen, 
 									      .checksum = 0};
 			sendIPv4packet(&streams[stream].remoteIP, &localIP, PROTO_UDP, udp.length, 2, 
-						   LAYERS({&udp, sizeof(udp)},
-								  {src, buflen}));
+						   LAYERS({&udp, sizeof(udp), LAYER_RAM},
+								  {src, buflen, LAYER_RAM}));
 			return buflen;
 
 		}
@@ -329,6 +490,49 @@ int16_t send(const int8_t stream, const void *const src, const uint16_t buflen,
 	return -1;
 }
 
+int16_t sendv(const int8_t stream, const struct Layer layers[], const uint8_t num, const uint8_t flags) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted) {
+		if(streams[stream].state == UDP_MODE) { // All the layers make up one datagram, sent right away
+			uint16_t len = 0;
+			struct Layer all[1 + num];
+			for(uint8_t i = 0; i < num; i++) {
+				len += layers[i].len;
+				all[1 + i] = layers[i];
+			}
+			const struct UDPheader udp = {.srcPort = streams[stream].localPort, 
+										  .destPort = streams[stream].remotePort, 
+										  .length = sizeof(udp) + len, 
+										  .checksum = 0};
+			all[0] = (struct Layer){&udp, sizeof(udp), LAYER_RAM};
+			sendIPv4packet(&streams[stream].remoteIP, &localIP, PROTO_UDP, udp.length, 1 + num, all);
+			return len;
+		}
+		else { // This is a TCP socket
+			return TCPsendv(stream, layers, num, flags);
+		}
+	}
+	return -1;
+}
+
+int16_t sendprogmem(const int8_t stream, const void *const src, const int16_t len, const uint8_t flags) {
+	if(stream < MAX_STREAMS && stream >= 0 && streams[stream].inUse && streams[stream].accepted && len >= 0) {
+		if(streams[stream].state == UDP_MODE) { // One datagram, written into the frame straight from flash
+			const struct UDPheader udp = {.srcPort = streams[stream].localPort, 
+										  .destPort = streams[stream].remotePort, 
+										  .length = sizeof(udp) + len, 
+										  .checksum = 0};
+			sendIPv4packet(&streams[stream].remoteIP, &localIP, PROTO_UDP, udp.length, 2, 
+						   LAYERS({&udp, sizeof(udp), LAYER_RAM},
+								  {src, len, LAYER_FLASH}));
+			return len;
+		}
+		else { // This is a TCP socket
+			return TCPsendProgmem(stream, src, len, flags);
+		}
+	}
+	return -1;
+}
+
 static void IPv4processor(const void *const restrict ip)
 {
 	switch(((struct IPv4header *)ip)->protocol)
@@ -390,7 +594,7 @@ static void ICMPv4processor(const void *const restrict ip, const void *const res
 			//icmpReply->checksum = checksumUnrolled(icmpReply, (uint8_t *)icmpReply + sizeof(reply));
 			icmpReply->checksum = ~checksumUpdate(0, icmpReply, sizeof(reply));
 
-			sendIPv4packet(&((struct IPv4header *)ip)->srcIP, &localIP, PROTO_ICMPv4, sizeof(reply), 1, LAYERS({reply, sizeof(reply)}));
+			sendIPv4packet(&((struct IPv4header *)ip)->srcIP, &localIP, PROTO_ICMPv4, sizeof(reply), 1, LAYERS({reply, sizeof(reply), LAYER_RAM}));
 			// Dest IP, Src IP, ICMPv4 code, total payload length, number of payloads, first payload content, size of first content
 			printf("Sent ping.\n");
 			break;
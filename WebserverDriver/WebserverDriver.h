@@ -7,6 +7,10 @@ extern "C" {
 #define MSG_DONTWAIT 0b00000001
 #define MSG_WAITALL  0b00000010
 
+// Options for setsockopt
+#define TCP_NODELAY 1 // Nonzero value disables Nagle's algorithm, so every send() goes out right away
+#define SO_BACKLOG 2 // How many connections a listening TCP socket may have in the middle of the handshake
+
 extern uint8_t NICsetup(void);
 extern void packetHandler(void);
 /* Use these for type in socketbind
@@ -20,14 +24,37 @@ extern int8_t socket(const uint8_t protocol);
 // Returns 0 on success, negative on failure
 extern int8_t bindlisten(const int8_t socket, const uint16_t port);
 
-// Returns a stream descriptor on success, negative on failure
-extern int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *const destIP);
+// Returns 0 on success, negative on failure. Streams use the options of the socket they belong to
+extern int8_t setsockopt(const int8_t socket, const uint8_t option, const uint8_t value);
+
+// Returns a stream descriptor on success, negative on failure. For TCP, blocks until the handshake is done
+// unless flags has MSG_DONTWAIT, in which case poll connected() on the returned stream
+extern int8_t connect(const int8_t socket, const uint16_t port, const struct IPv4 *const destIP, const uint8_t flags);
+
+// Returns 1 once a stream is connected, 0 while the TCP handshake is in progress, negative if it failed
+extern int8_t connected(const int8_t stream);
 
 // Returns a stream descriptor on success, negative on failure
 extern int8_t accept(const int8_t socket, const uint8_t flags);
 
 extern int16_t recv(const int8_t stream, void *const dest, const int16_t buflen, const uint8_t flags);
+
+// Like recv(), but instead of copying, fills spans with where the data is in the stream's RX buffer, one span for
+// each piece of it that is contiguous. Returns how many bytes the spans cover, the data stays until recvconsume().
+// For UDP the spans cover the next datagram, as much of it as maxSpans spans hold.
+extern int16_t recvpeek(const int8_t stream, struct Layer spans[], const uint8_t maxSpans, const uint8_t flags);
+// Frees len bytes after recvpeek() or drops the next datagram for UDP. Returns 0 on success, negative on failure
+extern int8_t recvconsume(const int8_t stream, const uint16_t len);
 extern int16_t send(const int8_t stream, const void *const src, const uint16_t buflen, const uint8_t flags);
+// Like send(), for data in flash (PROGMEM) that is sent from where it is instead of being copied into the TX buffer.
+// For TCP, nothing else can be sent until it is all ACKed. Blocks until all of it is queued unless flags has MSG_DONTWAIT,
+// then returns how much was. Returns negative on failure, or if len is negative.
+// One call sends at most 32767 bytes, and src must be in the low 64 KB of flash, since it is read with pgm_read_byte().
+extern int16_t sendprogmem(const int8_t stream, const void *const src, const int16_t len, const uint8_t flags);
+// Sends the data of num layers back to back, as one datagram for UDP. Their data can be in RAM or flash (LAYER_FLASH).
+// For TCP, returns how much was queued like send(), which stops at the first layer that didn't fit whole.
+// Returns negative on failure
+extern int16_t sendv(const int8_t stream, const struct Layer layers[], const uint8_t num, const uint8_t flags);
 
 extern void printPacket(const uint8_t *const p, const uint16_t len);
 